@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# End-to-end throughput benchmark for dns-anonimize.
+#
+# Generates deterministic synthetic captures with dns-anonimize-gen for a
+# few traffic profiles, runs dns-anonimize on each and reports packets/s,
+# MB/s, peak RSS and mapping table sizes from its JSON summary. Extra
+# arguments are passed on to dns-anonimize, to compare options:
+#
+#   ./dns-anonimize-bench.sh
+#   ./dns-anonimize-bench.sh -m rbtree
+#   ./dns-anonimize-bench.sh -j 0
+#
+# Environment:
+#   BENCH_DIR      where binaries and captures go (default: /tmp/dns-anonimize-bench)
+#   BENCH_PACKETS  packets per capture (default: 2000000)
+#   BENCH_RUNS     runs per profile, the fastest counts (default: 3)
+#   BENCH_PROFILES profiles to run (default: all)
+#   CC, CFLAGS     compiler (default: cc -O2)
+#
+##########################################################################
+#
+SRC=$(cd "$(dirname "$0")" && pwd)
+BENCH_DIR=${BENCH_DIR:-/tmp/dns-anonimize-bench}
+BENCH_PACKETS=${BENCH_PACKETS:-2000000}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_PROFILES=${BENCH_PROFILES:-"few-clients many-clients ipv6 mixed uniform"}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+
+# Generator options per profile
+profile_args() {
+	case "$1" in
+	few-clients)  echo "-c 1000 -C 1000 -6 30" ;;
+	many-clients) echo "-c 2000000 -C 500000 -6 30" ;;
+	ipv6)         echo "-c 1000 -C 1000000 -6 90 --per-net 2" ;;
+	mixed)        echo "-c 200000 -C 200000 -6 50 --tcp 20 --icmp 5 --frag 5 --other 30 --size 20-1400" ;;
+	uniform)      echo "-c 1000000 -C 1000000 -6 30 -z 0" ;;
+	*)            echo "unknown profile: $1" >&2; exit 1 ;;
+	esac
+}
+
+# Value of a number field in the JSON summary
+json_field() {
+	sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2" | head -1
+}
+
+mkdir -p "$BENCH_DIR" || exit 1
+$CC $CFLAGS -o "$BENCH_DIR/dns-anonimize-gen" "$SRC/dns-anonimize-gen.c" -lm || exit 1
+$CC $CFLAGS -o "$BENCH_DIR/dns-anonimize" "$SRC/dns-anonimize.c" -lpthread || exit 1
+
+printf "%-13s %10s %12s %9s %10s %9s %9s %9s\n" \
+	profile packets pkts/s MB/s "rss MB" ipv4 ipv6nets ipv6nodes
+for PROFILE in $BENCH_PROFILES
+do
+	ARGS=$(profile_args $PROFILE) || exit 1
+	PCAP="$BENCH_DIR/$PROFILE-$BENCH_PACKETS.pcap"
+	if [ ! -f "$PCAP" ]
+	then
+		"$BENCH_DIR/dns-anonimize-gen" -n $BENCH_PACKETS $ARGS "$PCAP" || exit 1
+	fi
+	BEST=""
+	for RUN in $(seq $BENCH_RUNS)
+	do
+		# Warm the page cache, so the first run is not penalized
+		cat "$PCAP" > /dev/null
+		"$BENCH_DIR/dns-anonimize" -q -s "$BENCH_DIR/run.json" "$@" \
+			"$PCAP" "$BENCH_DIR/out.pcap" || exit 1
+		PPS=$(json_field pkts_per_sec "$BENCH_DIR/run.json")
+		if [ -z "$BEST" ] || [ "${PPS%.*}" -gt "${BEST%.*}" ]
+		then
+			BEST=$PPS
+			cp "$BENCH_DIR/run.json" "$BENCH_DIR/best.json"
+		fi
+	done
+	J="$BENCH_DIR/best.json"
+	RSS=$(json_field peak_rss_kb "$J")
+	printf "%-13s %10s %12s %9s %10.1f %9s %9s %9s\n" $PROFILE \
+		$(json_field pkts_read "$J") $BEST \
+		$(json_field mbytes_per_sec "$J") $((RSS / 1024)).$((RSS % 1024 * 10 / 1024)) \
+		$(json_field ipv4nodes "$J") $(json_field ipv6nets "$J") \
+		$(json_field ipv6nodes "$J")
+done
+rm -f "$BENCH_DIR/out.pcap" "$BENCH_DIR/run.json"
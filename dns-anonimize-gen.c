@@ -0,0 +1,540 @@
+/*
+ * Copyright (c) 2001-2013, NLnet Labs. All rights reserved.
+ *
+ * This software is open source.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Deterministic synthetic DNS traffic for benchmarking dns-anonimize.
+ * The same options and seed always give the same pcap file.
+ *
+ * Build with: cc -O2 -o dns-anonimize-gen dns-anonimize-gen.c -lm
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t  thiszone;
+	int32_t  sigfigs;
+	int32_t  snaplen;
+	int32_t  linktype;
+};
+struct pcap_pkthdr {
+	uint32_t sec;
+	uint32_t usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/** Packet kinds */
+#define GEN_UDP   0
+#define GEN_TCP   1
+#define GEN_ICMP  2
+#define GEN_FRAG  3	/* IPv6 only, IPv4 gets UDP */
+#define GEN_OTHER 4	/* not DNS */
+
+/** What to generate */
+typedef struct gen_t gen_t;
+struct gen_t {
+	uint64_t     n_packets;
+	uint32_t     n_clients4;
+	uint32_t     n_clients6;
+	/** IPv6 clients sharing a /48 */
+	uint32_t     per_net6;
+	uint32_t     n_servers;
+	/** Percentages */
+	double       ipv6;
+	double       tcp;
+	double       icmp;
+	double       frag;
+	double       other;
+	/** Range of the DNS payload sizes */
+	uint32_t     min_size;
+	uint32_t     max_size;
+	/** Zipf exponent of the client popularity, 0 for uniform */
+	double       zipf;
+	uint64_t     seed;
+};
+
+/** splitmix64, small and good enough */
+static uint64_t rng_state;
+
+static inline uint64_t
+rng_next(void)
+{
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/** Uniform in [0, n) */
+static inline uint32_t
+rng_below(uint32_t n)
+{
+	return (uint32_t)(((rng_next() >> 32) * (uint64_t)n) >> 32);
+}
+
+/** Uniform in [0, 1) */
+static inline double
+rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/** A bijection on 32 bit values, to spread ids over the address space */
+static inline uint32_t
+permute32(uint32_t x, uint32_t salt)
+{
+	x ^= salt;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+/*
+ * Cumulative popularity of n clients with Zipf exponent s, for drawing
+ * client ids with zipf_draw(). NULL for uniform popularity.
+ */
+double*
+zipf_create(uint32_t n, double s)
+{
+	double* cdf;
+	double sum = 0;
+	uint32_t i;
+
+	if (s <= 0 || n == 0)
+		return NULL;
+	if (! (cdf = malloc(n * sizeof(double)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++)
+		cdf[i] = (sum += 1.0 / pow(i + 1, s));
+	for (i = 0; i < n; i++)
+		cdf[i] /= sum;
+	return cdf;
+}
+
+static inline uint32_t
+zipf_draw(const double* cdf, uint32_t n)
+{
+	double u;
+	uint32_t lo = 0, hi = n - 1, mid;
+
+	if (! cdf)
+		return rng_below(n);
+	u = rng_unit();
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline void
+put16(uint8_t* p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void
+put32(uint8_t* p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+client4(uint8_t* p, uint32_t id)
+{
+	put32(p, permute32(id, 0x4c4c4c4c));
+}
+
+static void
+client6(uint8_t* p, uint32_t id, uint32_t per_net)
+{
+	uint32_t net = id / per_net;
+
+	put16(p, 0x2001);
+	put32(p + 2, permute32(net, 0x6e6e6e6e));
+	put16(p + 6, 0);
+	put32(p + 8, permute32(id, 0x36363636));
+	put32(p + 12, permute32(id, 0x63636363));
+}
+
+static void
+server4(uint8_t* p, uint32_t id)
+{
+	put32(p, permute32(id, 0x53535353));
+}
+
+static void
+server6(uint8_t* p, uint32_t id)
+{
+	memset(p, 0, 16);
+	put16(p, 0x2a00);
+	put32(p + 2, permute32(id, 0x73737373));
+	p[15] = 0x53;
+}
+
+/** Transport header at p with ports, returns its length */
+static size_t
+transport(uint8_t* p, int tcp, uint16_t sport, uint16_t dport, size_t payload)
+{
+	if (tcp) {
+		memset(p, 0, 20);
+		put16(p, sport);
+		put16(p + 2, dport);
+		put32(p + 4, (uint32_t)rng_next());
+		p[12] = 5 << 4;
+		p[13] = 0x18;	/* PSH ACK */
+		put16(p + 14, 65535);
+		return 20;
+	}
+	put16(p, sport);
+	put16(p + 2, dport);
+	put16(p + 4, 8 + payload);
+	put16(p + 6, 0);
+	return 8;
+}
+
+/** A DNS message of len bytes at p: random id and flags, random rest */
+static void
+payload(uint8_t* p, size_t len, int response)
+{
+	size_t i;
+	uint64_t r = 0;
+
+	for (i = 0; i < len; i++) {
+		if (i % 8 == 0)
+			r = rng_next();
+		p[i] = r >> (i % 8 * 8);
+	}
+	if (len >= 4)
+		p[2] = response ? 0x81 : 0x01;
+}
+
+static void
+ipv4_header(uint8_t* p, uint8_t proto, size_t len, const uint8_t* src, const uint8_t* dst)
+{
+	p[0] = 0x45;
+	p[1] = 0;
+	put16(p + 2, len);
+	put16(p + 4, (uint16_t)rng_next());
+	put16(p + 6, 0x4000);
+	p[8] = 64;
+	p[9] = proto;
+	put16(p + 10, 0);
+	memcpy(p + 12, src, 4);
+	memcpy(p + 16, dst, 4);
+}
+
+static void
+ipv6_header(uint8_t* p, uint8_t next, size_t len, const uint8_t* src, const uint8_t* dst)
+{
+	put32(p, 0x60000000);
+	put16(p + 4, len);
+	p[6] = next;
+	p[7] = 64;
+	memcpy(p + 8, src, 16);
+	memcpy(p + 24, dst, 16);
+}
+
+/*
+ * Build a packet of the given kind between client and server in buf,
+ * which must hold 14 + 40 + 8 + 48 + 8 + max_size bytes. Returns its
+ * length.
+ */
+size_t
+packet(const gen_t* g, uint8_t* buf, int v6, int kind,
+	const uint8_t* client, const uint8_t* server)
+{
+	size_t n = g->min_size + rng_below(g->max_size - g->min_size + 1);
+	int response = rng_below(2);
+	const uint8_t* src = response ? server : client;
+	const uint8_t* dst = response ? client : server;
+	uint16_t cport = 1024 + rng_below(64512);
+	uint16_t sport = 53, dport = cport;
+	uint8_t* p;
+	size_t l4;
+
+	if (! response) {
+		sport = cport;
+		dport = 53;
+	}
+	if (kind == GEN_OTHER) {
+		/* NTP or HTTPS */
+		if (response)
+			sport = rng_below(2) ? 123 : 443;
+		else
+			dport = rng_below(2) ? 123 : 443;
+		kind = dport == 443 || sport == 443 ? GEN_TCP : GEN_UDP;
+	}
+	memcpy(buf, "\x00\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb", 12);
+	put16(buf + 12, v6 ? 0x86dd : 0x0800);
+	p = buf + 14 + (v6 ? 40 : 20);
+
+	switch (kind) {
+	case GEN_ICMP:
+		/* Port unreachable from the client for a response,
+		 * quoting the start of the response */
+		if (v6) {
+			p[0] = 1;
+			p[1] = 4;
+			put16(p + 2, 0);
+			put32(p + 4, 0);
+			ipv6_header(p + 8, 17, 8 + n, server, client);
+			transport(p + 48, 0, 53, cport, n);
+			payload(p + 56, 8, 1);
+			ipv6_header(buf + 14, 58, 64, client, server);
+			return 14 + 40 + 64;
+		}
+		p[0] = 3;
+		p[1] = 3;
+		put16(p + 2, 0);
+		put32(p + 4, 0);
+		ipv4_header(p + 8, 17, 28 + n, server, client);
+		transport(p + 28, 0, 53, cport, n);
+		payload(p + 36, 8, 1);
+		ipv4_header(buf + 14, 1, 20 + 44, client, server);
+		return 14 + 20 + 44;
+
+	case GEN_FRAG:
+		if (v6) {
+			/* First fragment of a large response */
+			p[0] = 17;
+			p[1] = 0;
+			put16(p + 2, 0x0001);
+			put32(p + 4, (uint32_t)rng_next());
+			l4 = transport(p + 8, 0, sport, dport, n);
+			payload(p + 8 + l4, n, response);
+			ipv6_header(buf + 14, 44, 8 + l4 + n, src, dst);
+			return 14 + 40 + 8 + l4 + n;
+		}
+		kind = GEN_UDP;
+		/* fall through */
+	default:
+		l4 = transport(p, kind == GEN_TCP, sport, dport, n);
+		payload(p + l4, n, response);
+		if (v6)
+			ipv6_header( buf + 14, kind == GEN_TCP ? 6 : 17
+			           , l4 + n, src, dst);
+		else
+			ipv4_header( buf + 14, kind == GEN_TCP ? 6 : 17
+			           , 20 + l4 + n, src, dst);
+		return 14 + (v6 ? 40 : 20) + l4 + n;
+	}
+}
+
+void
+generate(const gen_t* g, FILE* out)
+{
+	struct pcap_file_header fh = { 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1 };
+	struct pcap_pkthdr ph;
+	double* zipf4 = zipf_create(g->n_clients4, g->zipf);
+	double* zipf6 = zipf_create(g->n_clients6, g->zipf);
+	uint8_t* buf = malloc(14 + 40 + 8 + 48 + 8 + g->max_size);
+	uint8_t client[16], server[16];
+	uint64_t usec = 1500000000ULL * 1000000;
+	uint64_t i;
+	double r;
+	int v6, kind;
+
+	if (! buf) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	rng_state = g->seed;
+	fwrite(&fh, sizeof(fh), 1, out);
+	for (i = 0; i < g->n_packets; i++) {
+		v6 = g->n_clients4 == 0
+		  || (g->n_clients6 > 0 && rng_unit() * 100 < g->ipv6);
+		r = rng_unit() * 100;
+		kind = (r -= g->other) < 0 ? GEN_OTHER
+		     : (r -= g->tcp)   < 0 ? GEN_TCP
+		     : (r -= g->icmp)  < 0 ? GEN_ICMP
+		     : (r -= g->frag)  < 0 ? GEN_FRAG : GEN_UDP;
+		if (v6) {
+			client6( client, zipf_draw(zipf6, g->n_clients6)
+			       , g->per_net6);
+			server6(server, rng_below(g->n_servers));
+		} else {
+			client4(client, zipf_draw(zipf4, g->n_clients4));
+			server4(server, rng_below(g->n_servers));
+		}
+		ph.caplen = packet(g, buf, v6, kind, client, server);
+		ph.len    = ph.caplen;
+		usec += 1 + rng_below(20);
+		ph.sec    = usec / 1000000;
+		ph.usec   = usec % 1000000;
+		fwrite(&ph, sizeof(ph), 1, out);
+		fwrite(buf, ph.caplen, 1, out);
+	}
+	free(zipf4);
+	free(zipf6);
+	free(buf);
+}
+
+void usage(const char* progname)
+{
+	fprintf(stderr, "usage: %s [options] out.pcap\n"
+	       "\n"
+	       "  -n, --packets N        number of packets (default: 1000000)\n"
+	       "  -c, --clients N        unique IPv4 clients (default: 100000)\n"
+	       "  -C, --clients6 N       unique IPv6 clients (default: 100000)\n"
+	       "      --per-net N        IPv6 clients per /48 (default: 4)\n"
+	       "  -S, --servers N        servers (default: 100)\n"
+	       "  -6, --ipv6 PCT         share of IPv6 packets (default: 30)\n"
+	       "      --tcp PCT          share of DNS over TCP (default: 5)\n"
+	       "      --icmp PCT         share of ICMP errors (default: 1)\n"
+	       "      --frag PCT         share of IPv6 fragments (default: 1)\n"
+	       "      --other PCT        share of non-DNS packets (default: 10)\n"
+	       "      --size MIN-MAX     DNS payload sizes (default: 30-512)\n"
+	       "  -z, --zipf S           Zipf exponent of client popularity,\n"
+	       "                         0 for uniform (default: 1)\n"
+	       "  -r, --seed N           random seed (default: 1)\n"
+	       , progname);
+}
+
+int main(int argc, char** argv)
+{
+	static const struct option long_options[] = {
+		{ "packets",  required_argument, NULL, 'n' },
+		{ "clients",  required_argument, NULL, 'c' },
+		{ "clients6", required_argument, NULL, 'C' },
+		{ "per-net",  required_argument, NULL, 'N' },
+		{ "servers",  required_argument, NULL, 'S' },
+		{ "ipv6",     required_argument, NULL, '6' },
+		{ "tcp",      required_argument, NULL, 'T' },
+		{ "icmp",     required_argument, NULL, 'I' },
+		{ "frag",     required_argument, NULL, 'F' },
+		{ "other",    required_argument, NULL, 'O' },
+		{ "size",     required_argument, NULL, 'Z' },
+		{ "zipf",     required_argument, NULL, 'z' },
+		{ "seed",     required_argument, NULL, 'r' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ NULL,       0,                 NULL,  0  }
+	};
+	gen_t g = { 1000000, 100000, 100000, 4, 100
+	          , 30, 5, 1, 1, 10, 30, 512, 1, 1 };
+	FILE* out;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "n:c:C:S:6:z:r:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			g.n_packets = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			g.n_clients4 = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			g.n_clients6 = strtoul(optarg, NULL, 10);
+			break;
+		case 'N':
+			g.per_net6 = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			g.n_servers = strtoul(optarg, NULL, 10);
+			break;
+		case '6':
+			g.ipv6 = atof(optarg);
+			break;
+		case 'T':
+			g.tcp = atof(optarg);
+			break;
+		case 'I':
+			g.icmp = atof(optarg);
+			break;
+		case 'F':
+			g.frag = atof(optarg);
+			break;
+		case 'O':
+			g.other = atof(optarg);
+			break;
+		case 'Z':
+			if (sscanf(optarg, "%u-%u", &g.min_size, &g.max_size) != 2) {
+				fprintf(stderr, "bad size range: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'z':
+			g.zipf = atof(optarg);
+			break;
+		case 'r':
+			g.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(*argv);
+			return 0;
+		default:
+			usage(*argv);
+			return 1;
+		}
+	}
+	if (argc - optind != 1) {
+		usage(*argv);
+		return 1;
+	}
+	if (g.n_clients4 + g.n_clients6 == 0 || g.n_servers == 0
+	||  g.per_net6 == 0 || g.min_size < 12 || g.max_size < g.min_size
+	||  g.max_size > 65000) {
+		fprintf(stderr, "need clients, servers and sizes from 12 to 65000\n");
+		return 1;
+	}
+	if (argv[optind][0] == '-' && argv[optind][1] == 0)
+		out = stdout;
+	else if (! (out = fopen(argv[optind], "w"))) {
+		perror("could not open output");
+		exit(EXIT_FAILURE);
+	}
+	generate(&g, out);
+	if (fclose(out) != 0) {
+		perror("could not write output");
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
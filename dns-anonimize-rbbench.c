@@ -0,0 +1,502 @@
+/*
+ * Copyright (c) 2001-2013, NLnet Labs. All rights reserved.
+ *
+ * This software is open source.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the NLNET LABS nor the names of its contributors may
+ * be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Micro-benchmarks of the rbtree in dns-anonimize.c: insert, search,
+ * find_less_equal, next, build, merge, split, concat and delete with 4, 6
+ * and 16 byte keys (the mapping table keys), for uniform random, Zipfian
+ * and sequential access, against tree size. Reports ns/op and, where
+ * perf_event_open is available, cache misses/op. The trees that build,
+ * merge, split and concat make are checked, and a broken one ends the
+ * run with an error.
+ *
+ * Build with: cc -O2 -o dns-anonimize-rbbench dns-anonimize-rbbench.c -lpthread
+ */
+#define main dns_anonimize_main
+#include "dns-anonimize.c"
+#undef main
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/** Access patterns */
+#define DIST_UNIFORM    0
+#define DIST_ZIPF       1
+#define DIST_SEQUENTIAL 2
+
+static const char* dist_names[] = { "uniform", "zipf", "sequential" };
+
+/** splitmix64 */
+static uint64_t rng_state = 1;
+
+static inline uint64_t
+rng_next(void)
+{
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint32_t
+rng_below(uint32_t n)
+{
+	return (uint32_t)(((rng_next() >> 32) * (uint64_t)n) >> 32);
+}
+
+/** Cache miss counter, -1 when perf_event_open is not available */
+static int perf_fd = -1;
+
+void
+perf_open(void)
+{
+#if defined(__linux__) && defined(__NR_perf_event_open)
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type           = PERF_TYPE_HARDWARE;
+	attr.size           = sizeof(attr);
+	attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled       = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+	perf_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static struct timespec phase_start_ts;
+
+static void
+phase_start(void)
+{
+#ifdef __linux__
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &phase_start_ts);
+}
+
+/** Report the phase started last, of n_ops operations */
+static void
+phase_end(size_t keylen, int dist, size_t size, const char* op, size_t n_ops)
+{
+	struct timespec now;
+	uint64_t misses = 0;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#ifdef __linux__
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = 0;
+	}
+#endif
+	ns = (now.tv_sec - phase_start_ts.tv_sec) * 1e9
+	   + (now.tv_nsec - phase_start_ts.tv_nsec);
+	printf("%6zu %-10s %9zu %-16s %9.1f", keylen, dist_names[dist]
+	      , size, op, ns / n_ops);
+	if (perf_fd >= 0)
+		printf(" %10.2f\n", (double)misses / n_ops);
+	else
+		printf(" %10s\n", "-");
+	fflush(stdout);
+}
+
+/*
+ * Fill the keys of n nodes. Sequential keys are consecutive numbers in
+ * the low bytes behind a fixed prefix, in increasing order; the others
+ * are random.
+ */
+static void
+make_keys(rbnode_t* nodes, size_t n, size_t keylen, int dist)
+{
+	uint64_t v = 0;
+	size_t i, j;
+
+	for (i = 0; i < n; i++) {
+		memset(nodes[i].key, 0, sizeof(nodes[i].key));
+		if (dist == DIST_SEQUENTIAL) {
+			nodes[i].key[0] = 0x0a;
+			for (v = i, j = keylen; j-- > 1 && v; v >>= 8)
+				nodes[i].key[j] = v;
+		} else {
+			for (j = 0; j < keylen; j++) {
+				if (j % 8 == 0)
+					v = rng_next();
+				nodes[i].key[j] = v >> (j % 8 * 8);
+			}
+		}
+	}
+}
+
+/*
+ * The order in which to look up n_ops of n keys: random picks, Zipfian
+ * picks (popular keys scattered over the tree) or a repeated in order
+ * scan.
+ */
+static size_t*
+make_order(size_t n, size_t n_ops, int dist)
+{
+	size_t* order = malloc(n_ops * sizeof(size_t));
+	double* cdf = NULL;
+	size_t* rank = NULL;
+	double sum = 0, u;
+	size_t i, lo, hi, mid, t, tmp;
+
+	if (! order) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (dist == DIST_ZIPF) {
+		cdf  = malloc(n * sizeof(double));
+		rank = malloc(n * sizeof(size_t));
+		if (! cdf || ! rank) {
+			fprintf(stderr, "mem allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < n; i++) {
+			cdf[i] = (sum += 1.0 / (i + 1));
+			rank[i] = i;
+		}
+		/* Popularity is unrelated to key order */
+		for (i = n - 1; i > 0; i--) {
+			t = rng_below(i + 1);
+			tmp = rank[i];
+			rank[i] = rank[t];
+			rank[t] = tmp;
+		}
+	}
+	for (i = 0; i < n_ops; i++) {
+		switch (dist) {
+		case DIST_UNIFORM:
+			order[i] = rng_below(n);
+			break;
+		case DIST_ZIPF:
+			u = (rng_next() >> 11) * (sum / 9007199254740992.0);
+			for (lo = 0, hi = n - 1; lo < hi; ) {
+				mid = lo + (hi - lo) / 2;
+				if (cdf[mid] < u)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			order[i] = rank[lo];
+			break;
+		default:
+			order[i] = i % n;
+			break;
+		}
+	}
+	free(cdf);
+	free(rank);
+	return order;
+}
+
+static int (*key_cmp(size_t keylen))(const void*, const void*)
+{
+	return keylen == 4 ? ipv4cmp : keylen == 6 ? ipv6netcmp : ipv6cmp;
+}
+
+/** Defeats dead code elimination of the lookups */
+static volatile uintptr_t sink;
+
+static void
+check_fail(const char* after, const char* what)
+{
+	fprintf(stderr, "rbtree broken after %s: %s\n", after, what);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Check the subtree at node, with keys between those of lo and hi (when
+ * not NULL), and return its black height
+ */
+static int
+check_node(rbtree_t* tree, rbnode_t* node, rbnode_t* parent,
+	rbnode_t* lo, rbnode_t* hi, size_t* count, const char* after)
+{
+	int left, right;
+
+	if (node == RBTREE_NULL)
+		return 0;
+	if (node->parent != parent)
+		check_fail(after, "parent link");
+	if ((lo && tree->cmp(lo->key, node->key) >= 0)
+	||  (hi && tree->cmp(node->key, hi->key) >= 0))
+		check_fail(after, "key order");
+	if (node->color == RED
+	&&  (node->left->color == RED || node->right->color == RED))
+		check_fail(after, "red node with a red child");
+	left  = check_node(tree, node->left, node, lo, node, count, after);
+	right = check_node(tree, node->right, node, node, hi, count, after);
+	if (left != right)
+		check_fail(after, "black height");
+	(*count)++;
+	return left + (node->color == BLACK);
+}
+
+/** Check the red-black properties, key order, links and count of tree */
+static void
+check_tree(rbtree_t* tree, const char* after)
+{
+	size_t count = 0;
+
+	if (tree->root->color != BLACK)
+		check_fail(after, "red root");
+	(void) check_node( tree, tree->root, RBTREE_NULL, NULL, NULL
+	                 , &count, after);
+	if (tree->count != RBTREE_COUNT_UNKNOWN && count != tree->count)
+		check_fail(after, "count");
+	if (rbtree_null_node.color != BLACK
+	||  rbtree_null_node.left != RBTREE_NULL
+	||  rbtree_null_node.right != RBTREE_NULL)
+		check_fail(after, "null node changed");
+}
+
+void
+bench(size_t keylen, int dist, size_t n, size_t n_ops)
+{
+	rbnode_t* nodes = calloc(n, sizeof(rbnode_t));
+	rbtree_t* tree = rbtree_create(key_cmp(keylen));
+	rbtree_t* odd = rbtree_create(key_cmp(keylen));
+	rbtree_t* lower;
+	uint8_t (*probes)[16];
+	size_t *order, *insert, i, t, tmp, count;
+	rbnode_t *node, *found, **sorted, **halves;
+	uintptr_t acc = 0;
+
+	if (! nodes || ! tree || ! odd) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	make_keys(nodes, n, keylen, dist);
+	order = make_order(n, n_ops, dist);
+
+	/* Insert in key order for sequential, in random order otherwise */
+	if (! (insert = malloc(n * sizeof(size_t)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++)
+		insert[i] = i;
+	if (dist != DIST_SEQUENTIAL)
+		for (i = n - 1; i > 0; i--) {
+			t = rng_below(i + 1);
+			tmp = insert[i];
+			insert[i] = insert[t];
+			insert[t] = tmp;
+		}
+	phase_start();
+	for (i = 0; i < n; i++)
+		acc += (uintptr_t)rbtree_insert(tree, &nodes[insert[i]]);
+	phase_end(keylen, dist, n, "insert", n);
+
+	phase_start();
+	for (i = 0; i < n_ops; i++)
+		acc += (uintptr_t)rbtree_search(tree, nodes[order[i]].key);
+	phase_end(keylen, dist, n, "search", n_ops);
+
+	/* Probes between the keys: the key with its last byte changed */
+	if (! (probes = malloc(n_ops * sizeof(*probes)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n_ops; i++) {
+		memcpy(probes[i], nodes[order[i]].key, 16);
+		probes[i][keylen - 1] ^= 1 + rng_below(255);
+	}
+	phase_start();
+	for (i = 0; i < n_ops; i++) {
+		acc += rbtree_find_less_equal(tree, probes[i], &found);
+		acc += (uintptr_t)found;
+	}
+	phase_end(keylen, dist, n, "find_less_equal", n_ops);
+	free(probes);
+
+	phase_start();
+	for (node = rbtree_first(tree); node != RBTREE_NULL; node = rbtree_next(node))
+		acc += (uintptr_t)node;
+	phase_end(keylen, dist, n, "next", n);
+
+	/*
+	 * Rebuild the tree from its nodes in order, then from its even
+	 * nodes only and join the odd ones back in
+	 */
+	sorted = malloc(n * sizeof(rbnode_t*));
+	halves = malloc(n * sizeof(rbnode_t*));
+	if (! sorted || ! halves) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	count = 0;
+	for (node = rbtree_first(tree); node != RBTREE_NULL; node = rbtree_next(node))
+		sorted[count++] = node;
+	phase_start();
+	rbtree_build(tree, sorted, count);
+	phase_end(keylen, dist, n, "build", count);
+	check_tree(tree, "build");
+
+	/* The keys interleave, so the trees are merged */
+	for (i = 0; i < count; i++)
+		halves[i / 2 + (i % 2 ? (count + 1) / 2 : 0)] = sorted[i];
+	rbtree_build(tree, halves, (count + 1) / 2);
+	rbtree_build(odd, halves + (count + 1) / 2, count / 2);
+	phase_start();
+	rbtree_join(tree, odd);
+	phase_end(keylen, dist, n, "merge", count);
+	check_tree(tree, "merge");
+	check_tree(odd, "merge");
+	free(halves);
+
+	/*
+	 * Split at the keys of the lookups and concatenate the lower part
+	 * back on, checking both parts of the first split
+	 */
+	lower = rbtree_split_key(tree, sorted[count / 3]->key);
+	check_tree(lower, "split_key");
+	check_tree(tree, "split_key");
+	if (rbtree_count(lower) != count / 3
+	||  rbtree_count(tree) != count - count / 3
+	||  rbtree_first(tree) != sorted[count / 3])
+		check_fail("split_key", "split point");
+	rbtree_join(tree, lower);
+	check_tree(tree, "concat");
+	check_tree(lower, "concat");
+	rbtree_free(lower);
+	phase_start();
+	for (i = 0; i < n_ops; i++) {
+		lower = rbtree_split_key(tree, nodes[order[i]].key);
+		rbtree_join(tree, lower);
+		rbtree_free(lower);
+	}
+	phase_end(keylen, dist, n, "split_key+concat", n_ops);
+	check_tree(tree, "split_key+concat");
+
+	/* Concatenate the halves the other way around */
+	lower = rbtree_split(tree, count / 2);
+	check_tree(lower, "split");
+	check_tree(tree, "split");
+	phase_start();
+	rbtree_join(lower, tree);
+	phase_end(keylen, dist, n, "concat", 1);
+	check_tree(lower, "concat");
+	rbtree_join(tree, lower);
+	rbtree_free(lower);
+	for (i = 0, node = rbtree_first(tree); i < count; i++, node = rbtree_next(node))
+		if (node != sorted[i])
+			check_fail("concat", "nodes");
+	free(sorted);
+
+	phase_start();
+	for (i = 0; i < n; i++)
+		acc += (uintptr_t)rbtree_delete(tree, nodes[insert[i]].key);
+	phase_end(keylen, dist, n, "delete", n);
+
+	sink = acc;
+	free(insert);
+	free(order);
+	rbtree_free(odd);
+	rbtree_free(tree);
+	free(nodes);
+}
+
+void rbbench_usage(const char* progname)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+	       "\n"
+	       "  -s, --sizes N,N,...    tree sizes (default: 1000,16000,256000,1000000)\n"
+	       "  -l, --lookups N        lookups per size (default: 1000000)\n"
+	       "  -k, --keys N,N,...     key lengths, of 4, 6 and 16 (default: all)\n"
+	       , progname);
+}
+
+int main(int argc, char** argv)
+{
+	static const struct option long_options[] = {
+		{ "sizes",   required_argument, NULL, 's' },
+		{ "lookups", required_argument, NULL, 'l' },
+		{ "keys",    required_argument, NULL, 'k' },
+		{ "help",    no_argument,       NULL, 'h' },
+		{ NULL,      0,                 NULL,  0  }
+	};
+	const char* sizes = "1000,16000,256000,1000000";
+	const char* keys = "4,6,16";
+	size_t n_ops = 1000000;
+	const char *s, *k;
+	size_t n, keylen;
+	int opt, dist;
+
+	while ((opt = getopt_long(argc, argv, "s:l:k:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			sizes = optarg;
+			break;
+		case 'l':
+			n_ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			keys = optarg;
+			break;
+		case 'h':
+			rbbench_usage(*argv);
+			return 0;
+		default:
+			rbbench_usage(*argv);
+			return 1;
+		}
+	}
+	perf_open();
+	if (perf_fd < 0)
+		fprintf(stderr, "no cache miss counts: perf_event_open failed\n");
+
+	printf("%6s %-10s %9s %-16s %9s %10s\n"
+	      , "keylen", "access", "size", "op", "ns/op", "misses/op");
+	for (k = keys; *k; k += strcspn(k, ",") + (k[strcspn(k, ",")] == ',')) {
+		keylen = strtoul(k, NULL, 10);
+		if (keylen != 4 && keylen != 6 && keylen != 16) {
+			fprintf(stderr, "key length must be 4, 6 or 16\n");
+			return 1;
+		}
+		for (dist = DIST_UNIFORM; dist <= DIST_SEQUENTIAL; dist++)
+			for (s = sizes; *s; s += strcspn(s, ",") + (s[strcspn(s, ",")] == ',')) {
+				if ((n = strtoul(s, NULL, 10)) > 0)
+					bench(keylen, dist, n, n_ops ? n_ops : n);
+			}
+	}
+	return 0;
+}
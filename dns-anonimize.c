@@ -31,12 +31,47 @@
  * POSSIBILITY OF SUCH DAMAGE.
  *
  * Version 0.0.4
+ *
+ * Build with: cc -O2 -o dns-anonimize dns-anonimize.c -lpthread
+ * For compressed input and output add: -DHAVE_ZLIB -lz -DHAVE_ZSTD -lzstd
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 
 /** Node colour black */
@@ -77,11 +112,16 @@ rbnode_t	rbtree_null_node = {
 
 /** An entire red black tree */
 typedef struct rbtree_t rbtree_t;
+/** The count of a tree that has not been counted since a split */
+#define RBTREE_COUNT_UNKNOWN ((size_t) -1)
 /** definition for tree struct */
 struct rbtree_t {
 	/** The root of the red-black tree */
 	rbnode_t    *root;
-	/** The number of the nodes in the tree */
+	/**
+	 * The number of the nodes in the tree, or RBTREE_COUNT_UNKNOWN
+	 * after a split, until rbtree_count() counts them
+	 */
 	size_t       count;
 	/**
 	 * Key compare function. <0,0,>0 like strcmp.
@@ -289,7 +329,8 @@ rbtree_insert (rbtree_t *rbtree, rbnode_t *data)
 	data->parent = parent;
 	data->left = data->right = RBTREE_NULL;
 	data->color = RED;
-	rbtree->count++;
+	if (rbtree->count != RBTREE_COUNT_UNKNOWN)
+		rbtree->count++;
 
 	/* Insert it into the tree... */
 	if (parent != RBTREE_NULL) {
@@ -353,7 +394,7 @@ rbtree_delete(rbtree_t *rbtree, const void *key)
 	rbnode_t *to_delete;
 	rbnode_t *child;
 	if((to_delete = rbtree_search(rbtree, key)) == 0) return 0;
-	rbtree->count--;
+	if(rbtree->count != RBTREE_COUNT_UNKNOWN) rbtree->count--;
 
 	/* make sure we have at most one non-leaf child */
 	if(to_delete->left != RBTREE_NULL &&
@@ -643,9 +684,207 @@ rbtree_previous(rbnode_t *node)
 	return node;
 }
 
+/*
+ * The number of the nodes in the tree. After a split that takes walking
+ * all of them once, in O(n); the count is kept from then on.
+ */
+size_t
+rbtree_count(rbtree_t *rbtree)
+{
+	rbnode_t *node;
+	size_t count = 0;
+
+	if (rbtree->count != RBTREE_COUNT_UNKNOWN)
+		return rbtree->count;
+	for (node = rbtree_first(rbtree); node != RBTREE_NULL;
+	     node = rbtree_next(node))
+		count++;
+	rbtree->count = count;
+	return count;
+}
+
+/** Build the subtree of the sorted nodes[lo, hi) below parent */
+static rbnode_t *
+rbtree_build_range(rbnode_t **nodes, size_t lo, size_t hi,
+	rbnode_t *parent, int depth, int red_depth)
+{
+	rbnode_t *node;
+	size_t mid;
+
+	if (lo == hi)
+		return RBTREE_NULL;
+	mid = lo + (hi - lo) / 2;
+	node = nodes[mid];
+	node->parent = parent;
+	node->color = depth == red_depth ? RED : BLACK;
+	node->left  = rbtree_build_range(nodes, lo, mid, node, depth + 1,
+	                                 red_depth);
+	node->right = rbtree_build_range(nodes, mid + 1, hi, node, depth + 1,
+	                                 red_depth);
+	return node;
+}
+
+/*
+ * Make the tree hold the n nodes, which must be in increasing key order
+ * without duplicates, in O(n). Whatever the tree held before is dropped.
+ *
+ * Taking the middle node as the root of each subtree fills all levels but
+ * the deepest one. Painting only the nodes on that level red gives every
+ * path the same number of black nodes.
+ */
+void
+rbtree_build(rbtree_t *rbtree, rbnode_t **nodes, size_t n)
+{
+	int red_depth = 0;
+
+	/* The first level that is not full: floor(log2(n + 1)) */
+	while (((size_t)2 << red_depth) - 1 <= n)
+		red_depth++;
+	rbtree->root = rbtree_build_range(nodes, 0, n, RBTREE_NULL, 0,
+	                                  red_depth);
+	rbtree->count = n;
+}
+
+/** The number of black nodes on each path down from node */
+static int
+rbtree_black_height(rbnode_t *node)
+{
+	int bh = 0;
+
+	for (; node != RBTREE_NULL; node = node->left)
+		if (node->color == BLACK)
+			bh++;
+	return bh;
+}
+
+/*
+ * Join the subtrees at left and right, with black roots and black
+ * heights lbh and rbh, with mid in between: the keys in left are smaller
+ * than mid's and those in right larger. Returns the new root and its
+ * black height in *bh.
+ *
+ * mid is hung, red, off the spine of the higher subtree where the black
+ * heights meet, and fixed up from there as after an insert. That takes
+ * O(|lbh - rbh| + 1).
+ */
+static rbnode_t *
+rbtree_join_mid(rbnode_t *left, int lbh, rbnode_t *mid, rbnode_t *right,
+	int rbh, int *bh)
+{
+	rbnode_t *parent = RBTREE_NULL;
+	rbtree_t joined;
+	int h;
+
+	if (lbh > rbh) {
+		/* Down the right spine of left, to black height rbh */
+		joined.root = left;
+		for (h = lbh; left->color == RED || h > rbh; left = left->right) {
+			h -= left->color == BLACK;
+			parent = left;
+		}
+		parent->right = mid;
+	} else if (lbh < rbh) {
+		joined.root = right;
+		for (h = rbh; right->color == RED || h > lbh; right = right->left) {
+			h -= right->color == BLACK;
+			parent = right;
+		}
+		parent->left = mid;
+	} else
+		joined.root = mid;
+
+	mid->parent = parent;
+	mid->left = left;
+	mid->right = right;
+	mid->color = RED;
+	if (left != RBTREE_NULL)
+		left->parent = mid;
+	if (right != RBTREE_NULL)
+		right->parent = mid;
+	rbtree_insert_fixup(&joined, mid);
+
+	/*
+	 * The fixup only rearranges the nodes above mid, which stays on
+	 * top of the lower subtree, so count the black nodes up from there.
+	 */
+	for (h = lbh < rbh ? lbh : rbh; mid != RBTREE_NULL; mid = mid->parent)
+		h += mid->color == BLACK;
+	*bh = h;
+	return joined.root;
+}
+
+/*
+ * Split the subtree at node, of black height bh, into the nodes with keys
+ * smaller than key, in *left, and the others, in *right, with black roots
+ * and their black heights in *lbh and *rbh.
+ *
+ * Each node on the search path is joined with its subtree on the far side
+ * onto the piece on its side. The subtrees grow higher as the recursion
+ * unwinds, so the joins take O(log n) together.
+ */
+static void
+rbtree_split_node(rbnode_t *node, int bh, const void *key,
+	int (*cmp) (const void *, const void *),
+	rbnode_t **left, int *lbh, rbnode_t **right, int *rbh)
+{
+	rbnode_t *far;
+	int far_bh, r;
+
+	if (node == RBTREE_NULL) {
+		*left = *right = RBTREE_NULL;
+		*lbh = *rbh = 0;
+		return;
+	}
+	/* The black height of the children */
+	far_bh = bh - (node->color == BLACK);
+
+	if ((r = cmp(key, node->key)) <= 0) {
+		far = node->right;
+		rbtree_split_node(node->left, far_bh, key, cmp,
+		                  left, lbh, right, rbh);
+	} else {
+		far = node->left;
+		rbtree_split_node(node->right, far_bh, key, cmp,
+		                  left, lbh, right, rbh);
+	}
+	if (far != RBTREE_NULL) {
+		far->parent = RBTREE_NULL;
+		if (far->color == RED) {
+			far->color = BLACK;
+			far_bh++;
+		}
+	}
+	if (r <= 0)
+		*right = rbtree_join_mid(*right, *rbh, node, far, far_bh, rbh);
+	else
+		*left = rbtree_join_mid(far, far_bh, node, *left, *lbh, lbh);
+}
+
+/*
+ * Move the nodes of tree with keys smaller than key into the empty tree
+ * lower, in O(log n). Does not set the counts.
+ */
+static void
+rbtree_split_at(rbtree_t *tree, const void *key, rbtree_t *lower)
+{
+	int lbh, rbh;
+
+	rbtree_split_node(tree->root, rbtree_black_height(tree->root), key,
+	                  tree->cmp, &lower->root, &lbh, &tree->root, &rbh);
+	if (lower->root != RBTREE_NULL)
+		lower->root->parent = RBTREE_NULL;
+	if (tree->root != RBTREE_NULL)
+		tree->root->parent = RBTREE_NULL;
+}
+
 /**
  * split off elements number of elements from the start
  * of the name tree and return a new tree 
+ *
+ * Nodes do not know the size of their subtree, so finding the node to
+ * split at walks elements nodes from the start, or the rest from the
+ * end when the count is known and that is shorter. The split itself
+ * takes O(log n).
  */
 rbtree_t *
 rbtree_split(rbtree_t *tree,
@@ -653,17 +892,63 @@ rbtree_split(rbtree_t *tree,
 {
 	rbtree_t *new_tree;
 	rbnode_t *cur_node;
-	rbnode_t *move_node;
-	size_t count = 0;
+	size_t count;
 
 	new_tree = rbtree_create(tree->cmp);
+	if (!new_tree)
+		return NULL;
 
-	cur_node = rbtree_first(tree);
-	while (count < elements && cur_node != RBTREE_NULL) {
-		move_node = rbtree_delete(tree, cur_node->key);
-		(void)rbtree_insert(new_tree, move_node);
+	if (tree->count != RBTREE_COUNT_UNKNOWN && elements >= tree->count) {
+		cur_node = RBTREE_NULL;
+	} else if (tree->count != RBTREE_COUNT_UNKNOWN
+	       &&  elements > tree->count / 2) {
+		cur_node = rbtree_last(tree);
+		for (count = tree->count - 1; count > elements; count--)
+			cur_node = rbtree_previous(cur_node);
+	} else {
+		/* Runs off the end when the tree has no more than elements */
 		cur_node = rbtree_first(tree);
-		count++;
+		for (count = 0; count < elements && cur_node != RBTREE_NULL;
+		     count++)
+			cur_node = rbtree_next(cur_node);
+	}
+	if (cur_node == RBTREE_NULL) {
+		new_tree->root  = tree->root;
+		new_tree->count = tree->count;
+		tree->root  = RBTREE_NULL;
+		tree->count = 0;
+		return new_tree;
+	}
+	rbtree_split_at(tree, cur_node->key, new_tree);
+	new_tree->count = elements;
+	if (tree->count != RBTREE_COUNT_UNKNOWN)
+		tree->count -= elements;
+
+	return new_tree;
+}
+
+/*
+ * Split off the elements with keys smaller than key into a new tree, in
+ * O(log n). Nodes do not know the size of their subtree, so the counts
+ * of both parts are left unknown, for rbtree_count() to count when
+ * needed.
+ */
+rbtree_t *
+rbtree_split_key(rbtree_t *tree, const void *key)
+{
+	rbtree_t *new_tree;
+
+	new_tree = rbtree_create(tree->cmp);
+	if (!new_tree)
+		return NULL;
+
+	rbtree_split_at(tree, key, new_tree);
+	if (tree->root == RBTREE_NULL) {
+		new_tree->count = tree->count;
+		tree->count = 0;
+	} else if (new_tree->root != RBTREE_NULL) {
+		new_tree->count = RBTREE_COUNT_UNKNOWN;
+		tree->count = RBTREE_COUNT_UNKNOWN;
 	}
 
 	return new_tree;
@@ -690,14 +975,83 @@ traverse_postorder(rbtree_t* tree,
 	traverse_post(func, arg, tree->root);
 }
 
+/*
+ * Join the trees lower and upper, all keys in lower smaller than those
+ * in upper, into lower in O(log n): the first node of upper goes in
+ * between.
+ */
+static void
+rbtree_concat(rbtree_t *lower, rbtree_t *upper)
+{
+	size_t count = RBTREE_COUNT_UNKNOWN;
+	rbnode_t *mid;
+	int bh;
+
+	if (lower->count != RBTREE_COUNT_UNKNOWN
+	&&  upper->count != RBTREE_COUNT_UNKNOWN)
+		count = lower->count + upper->count;
+	mid = rbtree_delete(upper, rbtree_first(upper)->key);
+	lower->root = rbtree_join_mid(
+	    lower->root, rbtree_black_height(lower->root), mid,
+	    upper->root, rbtree_black_height(upper->root), &bh);
+	lower->count = count;
+}
+
 /*
  * add all node from the second tree to the first (removing them from the
  * second), and fix up nsec(3)s if present
+ *
+ * Nodes with a key the first tree has already are dropped. When all keys
+ * of one tree are smaller than those of the other, the trees are
+ * concatenated in O(log n); otherwise their nodes are merged in order
+ * into a newly built tree in O(n + m).
  */
 void
 rbtree_join(rbtree_t *tree1, rbtree_t *tree2)
 {
-	traverse_postorder(tree2, rbtree_insert_vref, tree1);
+	rbnode_t **nodes, *node1, *node2;
+	size_t n = 0;
+	int r;
+
+	if (tree2->root == RBTREE_NULL)
+		return;
+	if (tree1->root == RBTREE_NULL) {
+		tree1->root  = tree2->root;
+		tree1->count = tree2->count;
+	} else if (tree1->cmp(rbtree_last(tree1)->key,
+	                      rbtree_first(tree2)->key) < 0) {
+		rbtree_concat(tree1, tree2);
+	} else if (tree1->cmp(rbtree_last(tree2)->key,
+	                      rbtree_first(tree1)->key) < 0) {
+		rbtree_concat(tree2, tree1);
+		tree1->root  = tree2->root;
+		tree1->count = tree2->count;
+	} else if (!(nodes = malloc((rbtree_count(tree1) + rbtree_count(tree2))
+	                            * sizeof(rbnode_t *)))) {
+		traverse_postorder(tree2, rbtree_insert_vref, tree1);
+	} else {
+		node1 = rbtree_first(tree1);
+		node2 = rbtree_first(tree2);
+		while (node1 != RBTREE_NULL || node2 != RBTREE_NULL) {
+			if (node1 == RBTREE_NULL)
+				r = 1;
+			else if (node2 == RBTREE_NULL)
+				r = -1;
+			else
+				r = tree1->cmp(node1->key, node2->key);
+			if (r <= 0) {
+				nodes[n++] = node1;
+				node1 = rbtree_next(node1);
+			} else
+				nodes[n++] = node2;
+			if (r >= 0)
+				node2 = rbtree_next(node2);
+		}
+		rbtree_build(tree1, nodes, n);
+		free(nodes);
+	}
+	tree2->root  = RBTREE_NULL;
+	tree2->count = 0;
 }
 
 int ipv6cmp(const void* addr1, const void* addr2)
@@ -715,343 +1069,5760 @@ int ipv4cmp(const void* addr1, const void* addr2)
 	return memcmp(addr1, addr2, 4);
 }
 
-struct pcap_file_header {
-	uint32_t magic;
-	uint16_t version_major;
-	uint16_t version_minor;
-	int32_t  thiszone;
-	int32_t  sigfigs;
-	int32_t  snaplen;
-	int32_t  linktype;
-};
-struct pcap_pkthdr {
-	uint32_t sec;
-	uint32_t usec;
-	uint32_t caplen;
-	uint32_t len;
+/*
+ * Bump allocator handing out nodes from large contiguous blocks. Nothing
+ * is freed individually; all blocks are released at once with arena_free.
+ */
+typedef struct arena_t arena_t;
+struct arena_t {
+	/** Most recently allocated block, its first word links to the previous */
+	uint8_t     *block;
+	/** Bytes used in the current block */
+	size_t       used;
+	/** Size of each block */
+	size_t       block_size;
+	/** Number of blocks mapped */
+	size_t       n_blocks;
+	/** Number of allocations handed out */
+	size_t       n_allocs;
+	/** Bytes handed out */
+	size_t       n_bytes;
+	/** Try to back the blocks with huge pages */
+	int          hugepages;
 };
 
-rbtree_t*  ipv6nets  = NULL;
-rbtree_t*  ipv6nodes = NULL;
-uint32_t n_ipv6nets  = 0;
-uint32_t n_ipv6nodes = 0;
+/** 2MB, the x86_64 huge page size */
+#define ARENA_BLOCK_SIZE (2 * 1024 * 1024)
+#define ARENA_ALIGN      8
 
-void lookup_and_replace6(uint8_t* ipv6, uint16_t ipv6type)
+void
+arena_init(arena_t *arena, int hugepages)
 {
-	uint32_t  ipv6net;
-	uint32_t  ipv6node;
-	rbnode_t* node;
+	arena->block      = NULL;
+	arena->used       = 0;
+	arena->block_size = ARENA_BLOCK_SIZE;
+	arena->n_blocks   = 0;
+	arena->n_allocs   = 0;
+	arena->n_bytes    = 0;
+	arena->hugepages  = hugepages;
+}
 
-	ipv6type = ((ipv6type & 15) << 12) 
-		 | ((ipv6type & 15) <<  8)
-		 | ((ipv6type & 15) <<  4)
-		 |  (ipv6type & 15);
-	node = rbtree_search(ipv6nets, ipv6);
-	if (node) {
-		ipv6net = node->value;
-	} else {
-		node = malloc(sizeof(rbnode_t));
-		if (! node) {
-			fprintf(stderr, "mem allocation error\n");
-			exit(EXIT_FAILURE);
-		}
-		memcpy(node->key, ipv6, 6);
-		ipv6net = node->value = n_ipv6nets++;
-		rbtree_insert(ipv6nets, node);
-	}
-	node = rbtree_search(ipv6nodes, ipv6);
-	if (node) {
-		ipv6node = node->value;
-	} else {
-		node = malloc(sizeof(rbnode_t));
-		if (! node) {
-			fprintf(stderr, "mem allocation error\n");
+/** Map a new block and link it in front of the current one */
+void
+arena_new_block(arena_t *arena)
+{
+	uint8_t *block = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (arena->hugepages)
+		block = mmap(NULL, arena->block_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (block == MAP_FAILED) {
+		block = mmap(NULL, arena->block_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED) {
+			perror("could not map arena block");
 			exit(EXIT_FAILURE);
 		}
-		memcpy(node->key, ipv6, 16);
-		ipv6node = node->value = n_ipv6nodes++;
-		rbtree_insert(ipv6nodes, node);
+#ifdef MADV_HUGEPAGE
+		/* Transparent huge pages, when no reserved ones are left */
+		if (arena->hugepages)
+			(void) madvise(block, arena->block_size, MADV_HUGEPAGE);
+#endif
 	}
-
-	/* anonymize */
-	ipv6[ 0] = 0xca;
-	ipv6[ 1] = 0xfe;
-	ipv6[ 2] = (ipv6net  & 0xff000000) >> 24;
-	ipv6[ 3] = (ipv6net  & 0x00ff0000) >> 16;
-	ipv6[ 4] = (ipv6net  & 0x0000ff00) >>  8;
-	ipv6[ 5] =  ipv6net  & 0x000000ff;
-	ipv6[ 6] = (ipv6type & 0xff00) >> 8;
-	ipv6[ 7] =  ipv6type & 0x00ff;
-	ipv6[ 8] = (ipv6node & 0xff000000) >> 24;
-	ipv6[ 9] = (ipv6node & 0x00ff0000) >> 16;
-	ipv6[10] = (ipv6node & 0x0000ff00) >>  8;
-	ipv6[11] =  ipv6node & 0x000000ff;
-	ipv6[12] = 0;
-	ipv6[13] = 0;
-	ipv6[14] = 0;
-	ipv6[15] = 0;
+	*(uint8_t **)block = arena->block;
+	arena->block = block;
+	arena->used  = ARENA_ALIGN;
+	arena->n_blocks++;
 }
 
-rbtree_t*  ipv4nodes = NULL;
-uint32_t n_ipv4nodes = 0;
+static inline void *
+arena_alloc(arena_t *arena, size_t size)
+{
+	void *ptr;
 
-void lookup_and_replace4(uint8_t* ipv4, uint16_t ipv4type)
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (! arena->block || arena->used + size > arena->block_size)
+		arena_new_block(arena);
+	ptr = arena->block + arena->used;
+	arena->used += size;
+	arena->n_allocs++;
+	arena->n_bytes += size;
+	return ptr;
+}
+
+/** Release all blocks at once */
+void
+arena_free(arena_t *arena)
 {
-	uint32_t  ipv4node;
-	rbnode_t* node;
+	uint8_t *block, *prev;
 
-	node = rbtree_search(ipv4nodes, ipv4);
-	if (node) {
-		ipv4node = node->value;
-	} else {
-		node = malloc(sizeof(rbnode_t));
-		if (! node) {
-			fprintf(stderr, "mem allocation error\n");
-			exit(EXIT_FAILURE);
-		}
-		memcpy(node->key, ipv4, 4);
-		ipv4node = node->value = n_ipv4nodes++;
-		rbtree_insert(ipv4nodes, node);
+	for (block = arena->block; block; block = prev) {
+		prev = *(uint8_t **)block;
+		munmap(block, arena->block_size);
 	}
-	if (ipv4type == 2)
-		ipv4node |= 0x80000000;
-	else
-		ipv4node &= 0x7FFFFFFF;
+	arena_init(arena, arena->hugepages);
+}
 
-	/* anonymize */
-	ipv4[0] = (ipv4node & 0xff000000) >> 24;
-	ipv4[1] = (ipv4node & 0x00ff0000) >> 16;
-	ipv4[2] = (ipv4node & 0x0000ff00) >>  8;
-	ipv4[3] =  ipv4node & 0x000000ff;
+/** Bytes mapped by the arena */
+static inline size_t
+arena_footprint(const arena_t *arena)
+{
+	return arena->n_blocks * arena->block_size;
 }
 
-int main(int argc, char** argv)
+/*
+ * Open addressing (linear probing) hash map from fixed width address keys
+ * to sequential ids. The keys are stored inline in the slot array, so a
+ * lookup typically touches a single cache line.
+ *
+ * Slot layout: uint32_t id + 1 (0 for an empty slot), followed by the key.
+ * In a map with a spill, the top bit of the id is its CLOCK reference bit.
+ */
+#define ADDRMAP_REF 0x80000000U
+
+typedef struct spill_t spill_t;
+typedef struct addrmap_t addrmap_t;
+struct addrmap_t {
+	/** capacity * slotsize bytes */
+	uint8_t     *slots;
+	/** Number of slots, always a power of two */
+	size_t       capacity;
+	/** Number of occupied slots */
+	size_t       count;
+	/** Key width: 4, 6 or 16 */
+	size_t       keylen;
+	/** Bytes per slot (id + key, rounded up to 4) */
+	size_t       slotsize;
+	/** The slots are in a mapping owned by someone else */
+	int          mapped;
+	/** Where entries are evicted to under --max-mem, and the CLOCK hand */
+	spill_t     *spill;
+	size_t       hand;
+};
+
+#define ADDRMAP_INITIAL_CAPACITY 1024
+
+static inline size_t
+addrmap_slotsize(size_t keylen)
 {
-	FILE* in, *out;
-	struct pcap_file_header file_header;
-	struct pcap_pkthdr pkthdr;
-	size_t sz, hsz, hsz2;
-	uint8_t buf[16384];
-	uint16_t ethertype;
-	uint16_t src_port;
-	uint16_t dst_port;
+	return (sizeof(uint32_t) + keylen + 3) & ~(size_t)3;
+}
 
-	uint8_t* router;
-	uint8_t* dst_ns;
-	uint8_t* src_ns;
-	uint8_t* client;
+static inline uint64_t
+addrmap_hash(const uint8_t *key, size_t keylen)
+{
+	uint64_t a = 0, b = 0;
 
-	/* Handle arguments
-	 */
-	if (argc != 3) {
-		fprintf(stderr, "%s in.pcap out.anonymized.pcap\n", *argv);
-		return 1;
-	}
-	if (argv[1][0] == '-' && argv[1][1] == 0) {
-		in = stdin;
-	} else {
-		in = fopen(argv[1], "r");
-		if (! in) {
-			perror("could not open input");
-			exit(EXIT_FAILURE);
-		}
+	switch (keylen) {
+	case  4: memcpy(&a, key,  4);
+		 break;
+	case  6: memcpy(&a, key,  6);
+		 break;
+	default: memcpy(&a, key,  8);
+		 memcpy(&b, key + 8, 8);
+		 break;
 	}
-	if (argv[2][0] == '-' && argv[2][1] == 0) {
-		out = stdout;
-	} else {
-		out = fopen(argv[2], "w");
-		if (! in) {
-			perror("could not open output");
-			exit(EXIT_FAILURE);
-		}
-	}
-	
-	/* Check and copy header
-	 */
-	sz = fread(&file_header, sizeof(file_header), 1, in);
-	if (sz < 1) {
-		perror("could not read file header");
+	/* murmur3 finalizer over both halves */
+	a ^= b * 0x9e3779b97f4a7c15ULL;
+	a ^= a >> 33;
+	a *= 0xff51afd7ed558ccdULL;
+	a ^= a >> 33;
+	a *= 0xc4ceb9fe1a85ec53ULL;
+	a ^= a >> 33;
+	return a;
+}
+
+void
+addrmap_init(addrmap_t *map, size_t keylen)
+{
+	map->keylen   = keylen;
+	map->slotsize = addrmap_slotsize(keylen);
+	map->capacity = ADDRMAP_INITIAL_CAPACITY;
+	map->count    = 0;
+	map->mapped   = 0;
+	map->spill    = NULL;
+	map->hand     = 0;
+	map->slots    = calloc(map->capacity, map->slotsize);
+	if (! map->slots) {
+		fprintf(stderr, "mem allocation error\n");
 		exit(EXIT_FAILURE);
 	}
-	if (file_header.magic == (uint32_t)0xd4c3b2a1) {
-		fprintf(stderr, "cannot handle different byte orders yet\n");
+}
+
+addrmap_t *
+addrmap_create(size_t keylen)
+{
+	addrmap_t *map = malloc(sizeof(addrmap_t));
+
+	if (! map) {
+		fprintf(stderr, "mem allocation error\n");
 		exit(EXIT_FAILURE);
 	}
-	if (file_header.magic != 0xa1b2c3d4) {
-		fprintf(stderr, "input is not in pcap format\n");
+	addrmap_init(map, keylen);
+	return map;
+}
+
+void
+addrmap_free(addrmap_t *map)
+{
+	if (! map)
+		return;
+	if (! map->mapped)
+		free(map->slots);
+	free(map);
+}
+
+/** Bytes allocated for the slots */
+static inline size_t
+addrmap_footprint(const addrmap_t *map)
+{
+	return map ? map->capacity * map->slotsize : 0;
+}
+
+/** Double the capacity and reinsert all occupied slots */
+void
+addrmap_grow(addrmap_t *map)
+{
+	size_t    old_capacity = map->capacity;
+	uint8_t  *old_slots = map->slots;
+	size_t    mask, i, j;
+	uint8_t  *slot;
+
+	map->capacity *= 2;
+	map->slots = calloc(map->capacity, map->slotsize);
+	if (! map->slots) {
+		fprintf(stderr, "mem allocation error\n");
 		exit(EXIT_FAILURE);
 	}
-	sz = fwrite(&file_header, sizeof(file_header), 1, out);
-	if (sz < 1) {
-		perror("could not write file header");
-		exit(EXIT_FAILURE);
+	mask = map->capacity - 1;
+	for (i = 0; i < old_capacity; i++) {
+		slot = old_slots + i * map->slotsize;
+		if (*(uint32_t *)slot == 0)
+			continue;
+		j = addrmap_hash(slot + 4, map->keylen) & mask;
+		while (*(uint32_t *)(map->slots + j * map->slotsize))
+			j = (j + 1) & mask;
+		memcpy(map->slots + j * map->slotsize, slot, map->slotsize);
 	}
-	ipv6nets  = rbtree_create(ipv6netcmp);
-	ipv6nodes = rbtree_create(ipv6cmp);
-	ipv4nodes = rbtree_create(ipv4cmp);
+	if (! map->mapped)
+		free(old_slots);
+	map->mapped = 0;
+}
 
-	/* Modify and copy packets
-	 */
-	while (! feof(in)) {
-		sz = fread(&pkthdr, sizeof(pkthdr), 1, in);
-		if (sz < 1) {
-			break;
-		}
-		sz = fread(buf, pkthdr.caplen, 1, in);
-		if (sz < 1) {
-			break;
-		}
-		ethertype = buf[12] << 8 | buf[13];
+uint32_t addrmap_fault(addrmap_t *map, const uint8_t *key, size_t keylen,
+	uint32_t *counter);
 
-		switch (ethertype) {
-		case 0x0800: /* IPv4 */
+/** Mark the slot of a map with a spill as used and return its id */
+static inline uint32_t
+addrmap_touch(uint8_t *slot)
+{
+	uint32_t value = *(uint32_t *)slot;
 
-			if ((hsz = (buf[14] & 0x0F) * 4) < 20)
-				hsz = 20;
+	*(uint32_t *)slot = value | ADDRMAP_REF;
+	return (value & ~ADDRMAP_REF) - 1;
+}
 
-			/* UDP || TCP */
-			if (buf[23] == 17 || buf[23] == 6) { 
-				src_port = buf[hsz + 14] << 8 | buf[hsz + 15];
-				dst_port = buf[hsz + 16] << 8 | buf[hsz + 17];
-
-				if (src_port == 53) { /* dns response */
-					lookup_and_replace4(&buf[26], 2);
-					lookup_and_replace4(&buf[30], 1);
-				} else if (dst_port == 53) { /* dns request */
-					lookup_and_replace4(&buf[26], 1);
-					lookup_and_replace4(&buf[30], 2);
-				} else { /* non-dns packet! */
-					continue;
-				}
-				break;
+/*
+ * Return the id for key, assigning the next id from *counter when the key
+ * was not seen before. keylen is passed explicitly (and should be a
+ * constant at the call site) so the compare gets specialized.
+ */
+static inline uint32_t
+addrmap_lookup(addrmap_t *map, const uint8_t *key, size_t keylen,
+	uint32_t *counter)
+{
+	size_t    mask = map->capacity - 1;
+	size_t    i = addrmap_hash(key, keylen) & mask;
+	uint8_t  *slot;
 
-			} else if (buf[23] != 1)
-				continue;
+	for (;;) {
+		slot = map->slots + i * map->slotsize;
+		if (*(uint32_t *)slot == 0)
+			break;
+		if (memcmp(slot + 4, key, keylen) == 0) {
+			if (map->spill)
+				return addrmap_touch(slot);
+			return *(uint32_t *)slot - 1;
+		}
+		i = (i + 1) & mask;
+	}
+	if (map->spill)
+		return addrmap_fault(map, key, keylen, counter);
+	/* Not found, insert at the empty slot */
+	if ((map->count + 1) * 10 > map->capacity * 7) {
+		addrmap_grow(map);
+		return addrmap_lookup(map, key, keylen, counter);
+	}
+	memcpy(slot + 4, key, keylen);
+	*(uint32_t *)slot = *counter + 1;
+	map->count++;
+	return (*counter)++;
+}
 
-			/* Assume sender is the server. */
-			lookup_and_replace4(&buf[26], 2);
-			lookup_and_replace4(&buf[30], 1);
+/** Start loading the slot where the lookup of key begins */
+static inline void
+addrmap_prefetch(const addrmap_t *map, const uint8_t *key, size_t keylen)
+{
+	size_t i = addrmap_hash(key, keylen) & (map->capacity - 1);
 
-			if (buf[hsz + 14] != 3 && buf[hsz + 14] !=  4 &&
-			    buf[hsz + 14] != 5 && buf[hsz + 14] != 11)
-				/* ICMP without IP header payload */
+	__builtin_prefetch(map->slots + i * map->slotsize, 1);
+}
+
+/** Insert key with the given id; key must not be in the map yet */
+void
+addrmap_insert(addrmap_t *map, const uint8_t *key, size_t keylen,
+	uint32_t value)
+{
+	(void) addrmap_lookup(map, key, keylen, &value);
+}
+
+/*
+ * Spill store of the hash maps under a memory budget (--max-mem). A map
+ * that may not grow any further moves its entries that were not used
+ * since the CLOCK hand last passed them to an open addressing table in
+ * an unlinked file, mapped shared, so that the kernel writes its pages
+ * out and drops them rather than the process running out of memory. An
+ * address that comes back is found there and gets its old id again.
+ *
+ * A Bloom filter of the spilled keys spares the addresses seen for the
+ * first time the trip to the file. It is sized once from the budget, so
+ * past a key per byte of it more and more of them go through, and the
+ * lookups slow down instead of memory running out.
+ *
+ * Slot layout: uint32_t id + 1 (0 for an empty slot), the key length,
+ * which tells the keys of the maps apart, and the key padded to 16 bytes.
+ */
+#define SPILL_SLOT_SIZE        24
+#define SPILL_INITIAL_CAPACITY (1 << 16)
+/** The smallest budget, room for the filter and a few thousand entries */
+#define SPILL_MIN_BUDGET       (1024 * 1024)
+
+struct spill_t {
+	/** capacity * SPILL_SLOT_SIZE bytes, mapped from the file, which
+	 *  is only made on the first eviction */
+	uint8_t     *slots;
+	/** Number of slots, always a power of two, 0 before the file */
+	size_t       capacity;
+	/** Number of occupied slots */
+	size_t       count;
+	/** Bloom filter of the keys in the slots, filter_mask + 1 bits */
+	uint8_t     *filter;
+	uint64_t     filter_mask;
+	/** Bytes the slots of the maps may take together, and take */
+	size_t       budget;
+	size_t       table_bytes;
+	/** Entries evicted, looked for in the slots, and found there */
+	uint64_t     evictions;
+	uint64_t     probes;
+	uint64_t     faults;
+};
+
+/** Map size bytes of a new unlinked file in $TMPDIR */
+void *
+spill_map(size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char *fn;
+	void *map;
+	int fd;
+
+	if (! dir || ! *dir)
+		dir = "/tmp";
+	if (! (fn = malloc(strlen(dir) + 32))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(fn, "%s/dns-anonimize.XXXXXX", dir);
+	if ((fd = mkstemp(fn)) < 0) {
+		fprintf(stderr, "could not create spill file %s: %s\n"
+		       , fn, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	(void) unlink(fn);
+	free(fn);
+	if (ftruncate(fd, size) < 0) {
+		perror("could not size spill file");
+		exit(EXIT_FAILURE);
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("could not map spill file");
+		exit(EXIT_FAILURE);
+	}
+	(void) madvise(map, size, MADV_RANDOM);
+	return map;
+}
+
+spill_t *
+spill_create(size_t budget)
+{
+	spill_t *spill = calloc(1, sizeof(spill_t));
+	size_t filter_bytes = 4096;
+
+	if (! spill) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	/* An eighth of the budget, a byte per key at 2% false positives */
+	while (filter_bytes * 2 <= budget / 8)
+		filter_bytes *= 2;
+	if (! (spill->filter = calloc(1, filter_bytes))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	spill->filter_mask = (uint64_t)filter_bytes * 8 - 1;
+	spill->budget      = budget - filter_bytes;
+	/* The file is made on the first eviction, runs within the budget
+	 * do without */
+	return spill;
+}
+
+void
+spill_free(spill_t *spill)
+{
+	if (! spill)
+		return;
+	if (spill->slots)
+		munmap(spill->slots, spill->capacity * SPILL_SLOT_SIZE);
+	free(spill->filter);
+	free(spill);
+}
+
+/** Bytes of the spill file */
+static inline size_t
+spill_footprint(const spill_t *spill)
+{
+	return spill ? spill->capacity * SPILL_SLOT_SIZE : 0;
+}
+
+static inline uint64_t
+spill_hash(const uint8_t *key, size_t keylen)
+{
+	return addrmap_hash(key, keylen) ^ keylen * 0x9e3779b97f4a7c15ULL;
+}
+
+/** The slot of key, or the empty slot where it goes */
+static uint8_t *
+spill_find(spill_t *spill, const uint8_t *key, size_t keylen, uint64_t h)
+{
+	size_t    mask = spill->capacity - 1;
+	size_t    i = h & mask;
+	uint8_t  *slot;
+
+	for (;;) {
+		slot = spill->slots + i * SPILL_SLOT_SIZE;
+		if (*(uint32_t *)slot == 0
+		|| (slot[4] == keylen && memcmp(slot + 8, key, keylen) == 0))
+			return slot;
+		i = (i + 1) & mask;
+	}
+}
+
+/*
+ * Set the filter bits of h when set, or test them. Three bits, each
+ * from a remix of the hash.
+ */
+static inline int
+spill_filter(spill_t *spill, uint64_t h, int set)
+{
+	uint64_t bit;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		h ^= h >> 29;
+		h *= 0xbf58476d1ce4e5b9ULL;
+		bit = (h >> 7) & spill->filter_mask;
+		if (set)
+			spill->filter[bit >> 3] |= 1 << (bit & 7);
+		else if (! (spill->filter[bit >> 3] >> (bit & 7) & 1))
+			return 0;
+	}
+	return 1;
+}
+
+/** Double the capacity of the file and reinsert all occupied slots */
+void
+spill_grow(spill_t *spill)
+{
+	uint8_t  *old_slots = spill->slots;
+	size_t    old_capacity = spill->capacity;
+	uint8_t  *slot;
+	size_t    i;
+
+	spill->capacity *= 2;
+	spill->slots = spill_map(spill->capacity * SPILL_SLOT_SIZE);
+	for (i = 0; i < old_capacity; i++) {
+		slot = old_slots + i * SPILL_SLOT_SIZE;
+		if (*(uint32_t *)slot == 0)
+			continue;
+		memcpy( spill_find(spill, slot + 8, slot[4]
+		                  , spill_hash(slot + 8, slot[4]))
+		      , slot, SPILL_SLOT_SIZE);
+	}
+	munmap(old_slots, old_capacity * SPILL_SLOT_SIZE);
+}
+
+/** Keep the id of key, which may be there already from an earlier eviction */
+void
+spill_put(spill_t *spill, const uint8_t *key, size_t keylen, uint32_t value)
+{
+	uint64_t  h = spill_hash(key, keylen);
+	uint8_t  *slot;
+
+	if (! spill->slots) {
+		spill->capacity = SPILL_INITIAL_CAPACITY;
+		spill->slots = spill_map(spill->capacity * SPILL_SLOT_SIZE);
+	} else if ((spill->count + 1) * 10 > spill->capacity * 7)
+		spill_grow(spill);
+	slot = spill_find(spill, key, keylen, h);
+	if (*(uint32_t *)slot)
+		return;
+	*(uint32_t *)slot = value + 1;
+	slot[4] = keylen;
+	memcpy(slot + 8, key, keylen);
+	spill->count++;
+	(void) spill_filter(spill, h, 1);
+}
+
+/** Look for the id of key, returns 1 when found */
+int
+spill_get(spill_t *spill, const uint8_t *key, size_t keylen, uint32_t *value)
+{
+	uint64_t  h = spill_hash(key, keylen);
+	uint8_t  *slot;
+
+	if (! spill->count || ! spill_filter(spill, h, 0))
+		return 0;
+	spill->probes++;
+	slot = spill_find(spill, key, keylen, h);
+	if (*(uint32_t *)slot == 0)
+		return 0;
+	spill->faults++;
+	*value = *(uint32_t *)slot - 1;
+	return 1;
+}
+
+/** Put map under the budget of spill, with what it takes now */
+void
+addrmap_spill(addrmap_t *map, spill_t *spill)
+{
+	map->spill = spill;
+	map->hand  = 0;
+	spill->table_bytes += addrmap_footprint(map);
+}
+
+/** Empty slot i, moving back the entries after it whose probe passed it */
+void
+addrmap_remove(addrmap_t *map, size_t i)
+{
+	size_t    mask = map->capacity - 1;
+	size_t    j = i, home;
+	uint8_t  *slot;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		slot = map->slots + j * map->slotsize;
+		if (*(uint32_t *)slot == 0)
+			break;
+		home = addrmap_hash(slot + 4, map->keylen) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			memcpy(map->slots + i * map->slotsize, slot, map->slotsize);
+			i = j;
+		}
+	}
+	memset(map->slots + i * map->slotsize, 0, map->slotsize);
+	map->count--;
+}
+
+/*
+ * Evict the first entry from the CLOCK hand on that was not used since
+ * the hand last passed it, clearing the reference bits on the way.
+ *
+ * The hand visits the slots in the order of hand times an odd number,
+ * which is all of them once per round but scattered. Swept in slot order,
+ * the evictions would empty the slots behind the hand while inserts fill
+ * those ahead of it up to where the probes run on and on.
+ */
+void
+addrmap_evict(addrmap_t *map)
+{
+	size_t    mask = map->capacity - 1;
+	size_t    i;
+	uint8_t  *slot;
+	uint32_t  value;
+
+	for (;; map->hand++) {
+		i = (map->hand * 0x9e3779b97f4a7c15ULL) & mask;
+		slot = map->slots + i * map->slotsize;
+		value = *(uint32_t *)slot;
+		if (value & ADDRMAP_REF)
+			*(uint32_t *)slot = value & ~ADDRMAP_REF;
+		else if (value)
+			break;
+	}
+	spill_put(map->spill, slot + 4, map->keylen, value - 1);
+	map->spill->evictions++;
+	addrmap_remove(map, i);
+}
+
+/*
+ * The miss of addrmap_lookup in a map with a spill. The key gets its id
+ * back from the spill, or the next one from *counter, and an entry is
+ * evicted to make room for it when the map may not grow.
+ */
+uint32_t
+addrmap_fault(addrmap_t *map, const uint8_t *key, size_t keylen,
+	uint32_t *counter)
+{
+	spill_t  *spill = map->spill;
+	size_t    mask, i;
+	uint8_t  *slot;
+	uint32_t  id;
+
+	if (! spill_get(spill, key, keylen, &id)) {
+		if (*counter >= ADDRMAP_REF - 1) {
+			fprintf(stderr, "too many addresses for --max-mem\n");
+			exit(EXIT_FAILURE);
+		}
+		id = (*counter)++;
+	}
+	if ((map->count + 1) * 10 > map->capacity * 7) {
+		/* Growing takes the old and the new slots for a while */
+		if (spill->table_bytes + 2 * addrmap_footprint(map)
+		    <= spill->budget) {
+			spill->table_bytes += addrmap_footprint(map);
+			addrmap_grow(map);
+		} else
+			addrmap_evict(map);
+	}
+	mask = map->capacity - 1;
+	i = addrmap_hash(key, keylen) & mask;
+	while (*(uint32_t *)(slot = map->slots + i * map->slotsize))
+		i = (i + 1) & mask;
+	memcpy(slot + 4, key, keylen);
+	*(uint32_t *)slot = id + 1;
+	map->count++;
+	return id;
+}
+
+/*
+ * Direct indexed IPv4 table: a two level (16/16 bit) table of id + 1
+ * values, 0 meaning unseen. The second level pages of 64K entries are
+ * mapped on first use, so the table grows in 256KB steps up to a
+ * ceiling of 16GB when every /16 is seen.
+ */
+#define IPV4DIRECT_PAGE_ENTRIES 65536
+#define IPV4DIRECT_PAGE_SIZE    (IPV4DIRECT_PAGE_ENTRIES * sizeof(uint32_t))
+
+typedef struct ipv4direct_t ipv4direct_t;
+struct ipv4direct_t {
+	/** Second level pages indexed by the upper 16 bits of the address */
+	uint32_t    *pages[65536];
+	/** Number of pages mapped */
+	size_t       n_pages;
+	/** Number of addresses in the table */
+	size_t       count;
+};
+
+ipv4direct_t *
+ipv4direct_create(void)
+{
+	ipv4direct_t *table = calloc(1, sizeof(ipv4direct_t));
+
+	if (! table) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	return table;
+}
+
+void
+ipv4direct_free(ipv4direct_t *table)
+{
+	size_t i;
+
+	if (! table)
+		return;
+	for (i = 0; i < 65536; i++)
+		if (table->pages[i])
+			munmap(table->pages[i], IPV4DIRECT_PAGE_SIZE);
+	free(table);
+}
+
+uint32_t *
+ipv4direct_new_page(ipv4direct_t *table, uint32_t hi)
+{
+	uint32_t *page;
+
+	page = mmap(NULL, IPV4DIRECT_PAGE_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED) {
+		perror("could not map ipv4 table page");
+		exit(EXIT_FAILURE);
+	}
+	table->n_pages++;
+	return table->pages[hi] = page;
+}
+
+/*
+ * Return the id for ipv4, assigning the next id from *counter when the
+ * address was not seen before.
+ */
+static inline uint32_t
+ipv4direct_lookup(ipv4direct_t *table, const uint8_t *ipv4, uint32_t *counter)
+{
+	uint32_t  hi = ipv4[0] << 8 | ipv4[1];
+	uint32_t  lo = ipv4[2] << 8 | ipv4[3];
+	uint32_t *page = table->pages[hi];
+
+	if (! page)
+		page = ipv4direct_new_page(table, hi);
+	if (page[lo])
+		return page[lo] - 1;
+	table->count++;
+	page[lo] = *counter + 1;
+	return (*counter)++;
+}
+
+/** Start loading the entry of ipv4 */
+static inline void
+ipv4direct_prefetch(const ipv4direct_t *table, const uint8_t *ipv4)
+{
+	uint32_t *page = table->pages[ipv4[0] << 8 | ipv4[1]];
+
+	if (page)
+		__builtin_prefetch(page + (ipv4[2] << 8 | ipv4[3]), 1);
+}
+
+/** Insert ipv4 with the given id; ipv4 must not be in the table yet */
+void
+ipv4direct_insert(ipv4direct_t *table, const uint8_t *ipv4, uint32_t value)
+{
+	(void) ipv4direct_lookup(table, ipv4, &value);
+}
+
+/** Bytes mapped by the table */
+static inline size_t
+ipv4direct_footprint(const ipv4direct_t *table)
+{
+	return sizeof(ipv4direct_t) + table->n_pages * IPV4DIRECT_PAGE_SIZE;
+}
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t  thiszone;
+	int32_t  sigfigs;
+	int32_t  snaplen;
+	int32_t  linktype;
+};
+struct pcap_pkthdr {
+	uint32_t sec;
+	uint32_t usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/*
+ * pcapng files are a sequence of blocks, each starting with its type and
+ * total length (and ending with that length again). A section header
+ * block starts every section and sets its byte order; interface
+ * description blocks give the link type for the packets of each
+ * interface in the section.
+ */
+#define PCAPNG_SHB  0x0a0d0d0a	/* same in both byte orders */
+#define PCAPNG_IDB  0x00000001
+#define PCAPNG_PB   0x00000002	/* obsolete packet block */
+#define PCAPNG_SPB  0x00000003
+#define PCAPNG_NRB  0x00000004
+#define PCAPNG_EPB  0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+/** Link types, from the pcap header or a pcapng interface description */
+#define LINKTYPE_NULL         0
+#define LINKTYPE_ETHERNET     1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LOOP       108
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+/** pcap magic numbers, for micro and nanosecond timestamps */
+#define PCAP_MAGIC    0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+/** Input formats */
+#define FMT_PCAP         0
+#define FMT_PCAPNG       1
+/** pcap in the other byte order, record headers are swapped as we go */
+#define FMT_PCAP_SWAPPED 2
+
+/** For specializing the record loops per format */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/** Mapping table implementations */
+#define MAP_HASH   0
+#define MAP_RBTREE 1
+/** IPv4 only */
+#define MAP_DIRECT 2
+
+int map_backend  = MAP_HASH;
+int ipv4_backend = MAP_HASH;
+
+/** All rbtree nodes of the mapping tables are allocated from here */
+arena_t node_arena;
+
+/** Budget of the hash maps, 0 for none, and where they evict to */
+size_t   max_mem = 0;
+spill_t* addr_spill = NULL;
+
+/*
+ * Return the id for key in rbtree, assigning the next id from *counter
+ * when the key was not seen before.
+ */
+uint32_t rbtree_lookup(rbtree_t* rbtree, const uint8_t* key, size_t keylen,
+	uint32_t* counter)
+{
+	rbnode_t* node;
+
+	node = rbtree_search(rbtree, key);
+	if (node)
+		return node->value;
+
+	node = arena_alloc(&node_arena, sizeof(rbnode_t));
+	memcpy(node->key, key, keylen);
+	node->value = (*counter)++;
+	rbtree_insert(rbtree, node);
+	return node->value;
+}
+
+rbtree_t*  ipv6nets  = NULL;
+rbtree_t*  ipv6nodes = NULL;
+addrmap_t* ipv6nets_hash  = NULL;
+addrmap_t* ipv6nodes_hash = NULL;
+uint32_t n_ipv6nets  = 0;
+uint32_t n_ipv6nodes = 0;
+
+/** Seconds per epoch, 0 for one epoch for all time */
+uint32_t epoch_secs = 0;
+/** Tag anonymized IPv6 addresses with the number of their epoch */
+int      epoch_tagging = 0;
+/** The current epoch ends at this second, 0 before the first packet */
+uint64_t epoch_end = 0;
+/** Goes into bytes 12 to 15 of anonymized IPv6 addresses (--epoch-tag) */
+uint32_t epoch_tag = 0;
+
+/** The id of the /48 of ipv6, assigning a new one when not seen before */
+static inline uint32_t ipv6net_id(const uint8_t* ipv6)
+{
+	if (map_backend == MAP_HASH)
+		return addrmap_lookup(ipv6nets_hash, ipv6, 6, &n_ipv6nets);
+	else
+		return rbtree_lookup(ipv6nets, ipv6, 6, &n_ipv6nets);
+}
+
+/** The id of ipv6, assigning a new one when not seen before */
+static inline uint32_t ipv6node_id(const uint8_t* ipv6)
+{
+	if (map_backend == MAP_HASH)
+		return addrmap_lookup(ipv6nodes_hash, ipv6, 16, &n_ipv6nodes);
+	else
+		return rbtree_lookup(ipv6nodes, ipv6, 16, &n_ipv6nodes);
+}
+
+void lookup_and_replace6(uint8_t* ipv6, uint16_t ipv6type)
+{
+	uint32_t  ipv6net;
+	uint32_t  ipv6node;
+
+	ipv6type = ((ipv6type & 15) << 12) 
+		 | ((ipv6type & 15) <<  8)
+		 | ((ipv6type & 15) <<  4)
+		 |  (ipv6type & 15);
+	ipv6net  = ipv6net_id(ipv6);
+	ipv6node = ipv6node_id(ipv6);
+
+	/* anonymize */
+	ipv6[ 0] = 0xca;
+	ipv6[ 1] = 0xfe;
+	ipv6[ 2] = (ipv6net  & 0xff000000) >> 24;
+	ipv6[ 3] = (ipv6net  & 0x00ff0000) >> 16;
+	ipv6[ 4] = (ipv6net  & 0x0000ff00) >>  8;
+	ipv6[ 5] =  ipv6net  & 0x000000ff;
+	ipv6[ 6] = (ipv6type & 0xff00) >> 8;
+	ipv6[ 7] =  ipv6type & 0x00ff;
+	ipv6[ 8] = (ipv6node & 0xff000000) >> 24;
+	ipv6[ 9] = (ipv6node & 0x00ff0000) >> 16;
+	ipv6[10] = (ipv6node & 0x0000ff00) >>  8;
+	ipv6[11] =  ipv6node & 0x000000ff;
+	ipv6[12] = (epoch_tag & 0xff000000) >> 24;
+	ipv6[13] = (epoch_tag & 0x00ff0000) >> 16;
+	ipv6[14] = (epoch_tag & 0x0000ff00) >>  8;
+	ipv6[15] =  epoch_tag & 0x000000ff;
+}
+
+rbtree_t*  ipv4nodes = NULL;
+addrmap_t* ipv4nodes_hash = NULL;
+ipv4direct_t* ipv4nodes_direct = NULL;
+uint32_t n_ipv4nodes = 0;
+
+/** The id of ipv4, assigning a new one when not seen before */
+static inline uint32_t ipv4_id(const uint8_t* ipv4)
+{
+	if (ipv4_backend == MAP_DIRECT)
+		return ipv4direct_lookup(ipv4nodes_direct, ipv4, &n_ipv4nodes);
+	else if (ipv4_backend == MAP_HASH)
+		return addrmap_lookup(ipv4nodes_hash, ipv4, 4, &n_ipv4nodes);
+	else
+		return rbtree_lookup(ipv4nodes, ipv4, 4, &n_ipv4nodes);
+}
+
+/*
+ * Start loading what the lookups of the address at addr will touch, so
+ * that the lookups of a batch of packets overlap their cache misses.
+ * Only the hash and direct tables gain from this.
+ */
+static inline void lookup_prefetch(const uint8_t* addr, int family)
+{
+	if (family == 6) {
+		if (map_backend == MAP_HASH) {
+			addrmap_prefetch(ipv6nets_hash, addr, 6);
+			addrmap_prefetch(ipv6nodes_hash, addr, 16);
+		}
+	} else if (ipv4_backend == MAP_HASH)
+		addrmap_prefetch(ipv4nodes_hash, addr, 4);
+	else if (ipv4_backend == MAP_DIRECT)
+		ipv4direct_prefetch(ipv4nodes_direct, addr);
+}
+
+void lookup_and_replace4(uint8_t* ipv4, uint16_t ipv4type)
+{
+	uint32_t  ipv4node;
+
+	ipv4node = ipv4_id(ipv4);
+	if (ipv4type == 2)
+		ipv4node |= 0x80000000;
+	else
+		ipv4node &= 0x7FFFFFFF;
+
+	/* anonymize */
+	ipv4[0] = (ipv4node & 0xff000000) >> 24;
+	ipv4[1] = (ipv4node & 0x00ff0000) >> 16;
+	ipv4[2] = (ipv4node & 0x0000ff00) >>  8;
+	ipv4[3] =  ipv4node & 0x000000ff;
+}
+
+/*
+ * Batched output writer. Records are collected as iovecs in one of two
+ * batches; a full batch is handed to a writer thread that submits it
+ * with writev, while the packet loop fills the other one. Data passed
+ * by reference must stay valid until the second writer_flush after it
+ * was added; data that is copied goes into the batch's own buffer.
+ */
+#define WRITER_BATCH_BYTES (4 * 1024 * 1024)
+#ifdef IOV_MAX
+#define WRITER_BATCH_IOVS  IOV_MAX
+#else
+#define WRITER_BATCH_IOVS  1024
+#endif
+
+typedef struct wbatch_t wbatch_t;
+struct wbatch_t {
+	struct iovec iov[WRITER_BATCH_IOVS];
+	/** Number of iovecs in use */
+	int          n_iov;
+	/** Total number of bytes referenced by iov */
+	size_t       n_bytes;
+	/** Buffer for copied data, WRITER_BATCH_BYTES large */
+	uint8_t     *data;
+	/** Bytes used in data */
+	size_t       data_len;
+};
+
+typedef struct writer_t writer_t;
+struct writer_t {
+	int          fd;
+	/** Batch being filled by the packet loop, and the one in flight */
+	wbatch_t     batches[2];
+	int          cur;
+	/** Set when batches[!cur] is submitted and not yet written */
+	int          busy;
+	/** Set to make the writer thread exit */
+	int          closing;
+	pthread_t    thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	/** Statistics */
+	size_t       n_writev;
+	size_t       n_written;
+};
+
+/** writev all of iov, handling partial writes. Modifies iov. */
+void
+writev_all(int fd, struct iovec *iov, int n_iov)
+{
+	ssize_t n;
+
+	while (n_iov > 0) {
+		n = writev(fd, iov, n_iov > WRITER_BATCH_IOVS
+		                    ? WRITER_BATCH_IOVS : n_iov);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("could not write packets");
+			exit(EXIT_FAILURE);
+		}
+		while (n_iov > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			n_iov--;
+		}
+		if (n_iov > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/** pwritev all of iov at off, handling partial writes. Modifies iov. */
+void
+pwritev_all(int fd, struct iovec *iov, int n_iov, off_t off)
+{
+	ssize_t n;
+
+	while (n_iov > 0) {
+		n = pwritev(fd, iov, n_iov > WRITER_BATCH_IOVS
+		                     ? WRITER_BATCH_IOVS : n_iov, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("could not write packets");
+			exit(EXIT_FAILURE);
+		}
+		off += n;
+		while (n_iov > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			n_iov--;
+		}
+		if (n_iov > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/** Write out a batch and empty it */
+void
+wbatch_write(int fd, wbatch_t *batch)
+{
+	writev_all(fd, batch->iov, batch->n_iov);
+	batch->n_iov    = 0;
+	batch->n_bytes  = 0;
+	batch->data_len = 0;
+}
+
+void *
+writer_thread(void *arg)
+{
+	writer_t *w = arg;
+	wbatch_t *batch;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (! w->busy && ! w->closing)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (! w->busy)
+			break;
+		batch = &w->batches[! w->cur];
+		w->n_writev++;
+		w->n_written += batch->n_bytes;
+		pthread_mutex_unlock(&w->lock);
+
+		wbatch_write(w->fd, batch);
+
+		pthread_mutex_lock(&w->lock);
+		w->busy = 0;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+writer_t *
+writer_open(int fd)
+{
+	writer_t *w = calloc(1, sizeof(writer_t));
+
+	if (! w || ! (w->batches[0].data = malloc(WRITER_BATCH_BYTES))
+	        || ! (w->batches[1].data = malloc(WRITER_BATCH_BYTES))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	w->fd = fd;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+		fprintf(stderr, "could not start writer thread\n");
+		exit(EXIT_FAILURE);
+	}
+	return w;
+}
+
+/*
+ * Hand the current batch to the writer thread, after waiting for the
+ * previous one to finish. On return, everything added before the
+ * previous flush has been written.
+ */
+void
+writer_flush(writer_t *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->cond, &w->lock);
+	if (w->batches[w->cur].n_iov) {
+		w->cur = ! w->cur;
+		w->busy = 1;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/** Wait until everything added so far has been written */
+void
+writer_sync(writer_t *w)
+{
+	writer_flush(w);
+	writer_flush(w);
+}
+
+/** Add len bytes at data to the current batch by reference */
+static inline void
+writer_ref(writer_t *w, const void *data, size_t len)
+{
+	wbatch_t *batch = &w->batches[w->cur];
+	struct iovec *last;
+
+	if (batch->n_iov) {
+		last = &batch->iov[batch->n_iov - 1];
+		if ((uint8_t *)last->iov_base + last->iov_len == data) {
+			/* Adjacent to the previous record, extend it */
+			last->iov_len += len;
+			batch->n_bytes += len;
+			goto added;
+		}
+		if (batch->n_iov == WRITER_BATCH_IOVS) {
+			writer_flush(w);
+			batch = &w->batches[w->cur];
+		}
+	}
+	batch->iov[batch->n_iov].iov_base = (void *)data;
+	batch->iov[batch->n_iov].iov_len  = len;
+	batch->n_iov++;
+	batch->n_bytes += len;
+added:
+	if (batch->n_bytes >= WRITER_BATCH_BYTES)
+		writer_flush(w);
+}
+
+/** Add a copy of len bytes at data to the current batch */
+static inline void
+writer_copy(writer_t *w, const void *data, size_t len)
+{
+	wbatch_t *batch = &w->batches[w->cur];
+
+	if (len > WRITER_BATCH_BYTES) {
+		/* Does not fit any batch, write it synchronously */
+		writer_ref(w, data, len);
+		writer_sync(w);
+		return;
+	}
+	if (batch->data_len + len > WRITER_BATCH_BYTES
+	||  batch->n_iov == WRITER_BATCH_IOVS) {
+		/* Flush before copying, as the iovec must be in the same
+		 * batch as the buffer it points into */
+		writer_flush(w);
+		batch = &w->batches[w->cur];
+	}
+	memcpy(batch->data + batch->data_len, data, len);
+	batch->data_len += len;
+	writer_ref(w, batch->data + batch->data_len - len, len);
+}
+
+/** Write out everything and stop the writer thread */
+void
+writer_close(writer_t *w)
+{
+	writer_sync(w);
+	pthread_mutex_lock(&w->lock);
+	w->closing = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->batches[0].data);
+	free(w->batches[1].data);
+	free(w);
+}
+
+/*
+ * Compressed input and output. A codec thread (de)compresses between the
+ * file and a pipe, and the packet loop reads or writes the other end of
+ * that pipe like any stream, so compression runs next to it instead of
+ * in it. zstd compression adds its own worker threads on top.
+ */
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+
+#define CODEC_BUFSZ (1024 * 1024)
+
+typedef struct codec_t codec_t;
+struct codec_t {
+	int          method;
+	/** Compressed input, of which head_len bytes in head were read already */
+	FILE        *in;
+	uint8_t      head[sizeof(struct pcap_file_header)];
+	size_t       head_len;
+	/** Compressed output */
+	int          out_fd;
+	int          level;
+	int          threads;
+	/** The codec thread's end of the pipe */
+	int          pipe_fd;
+	/** The packet loop's end of the pipe */
+	int          fd;
+	pthread_t    thread;
+	/** Set when the input turned out corrupt, truncated or unreadable */
+	int          failed;
+};
+
+/** The compression of the data starting with the len bytes at buf */
+int
+compress_magic(const uint8_t* buf, size_t len)
+{
+	if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)
+		return COMPRESS_GZIP;
+	if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5
+	             && buf[2] == 0x2f && buf[3] == 0xfd)
+		return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+/** The compression for a file named fn */
+int
+compress_extension(const char* fn)
+{
+	size_t len = strlen(fn);
+
+	if (len > 3 && strcmp(fn + len - 3, ".gz") == 0)
+		return COMPRESS_GZIP;
+	if (len > 4 && strcmp(fn + len - 4, ".zst") == 0)
+		return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+/** Write all len bytes at buf to fd */
+void
+codec_write(int fd, const void* buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len  = len;
+	writev_all(fd, &iov, 1);
+}
+
+/** Read up to bufsz bytes of compressed input, the head first */
+size_t
+codec_read(codec_t* c, uint8_t* buf, size_t bufsz)
+{
+	size_t n = 0;
+
+	if (c->head_len) {
+		memcpy(buf, c->head, c->head_len);
+		n = c->head_len;
+		c->head_len = 0;
+	}
+	n += fread(buf + n, 1, bufsz - n, c->in);
+	if (ferror(c->in)) {
+		perror("could not read compressed input");
+		c->failed = 1;
+	}
+	return n;
+}
+
+void
+codec_unsupported(const char* name)
+{
+	fprintf(stderr, "%s support is not built in\n", name);
+	exit(EXIT_FAILURE);
+}
+
+#ifdef HAVE_ZLIB
+/** Inflate the input into the pipe, following concatenated members */
+static void
+gzip_decompress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	z_stream z;
+	int r = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		fprintf(stderr, "could not initialize zlib\n");
+		exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		if (z.avail_in == 0) {
+			z.next_in  = ibuf;
+			z.avail_in = codec_read(c, ibuf, CODEC_BUFSZ);
+			if (z.avail_in == 0)
+				break;
+		}
+		if (r == Z_STREAM_END)
+			inflateReset(&z);
+		z.next_out  = obuf;
+		z.avail_out = CODEC_BUFSZ;
+		r = inflate(&z, Z_NO_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+			fprintf(stderr, "corrupt gzip input: %s\n"
+			       , z.msg ? z.msg : "unknown error");
+			inflateEnd(&z);
+			c->failed = 1;
+			return;
+		}
+		codec_write(c->pipe_fd, obuf, CODEC_BUFSZ - z.avail_out);
+	}
+	if (r != Z_STREAM_END) {
+		fprintf(stderr, "gzip input ends early\n");
+		c->failed = 1;
+	}
+	inflateEnd(&z);
+}
+
+/** Deflate the pipe into the output as a gzip file */
+static void
+gzip_compress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	z_stream z;
+	ssize_t n;
+	int flush;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2( &z, c->level >= 0 ? c->level : Z_DEFAULT_COMPRESSION
+	                , Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "could not initialize zlib\n");
+		exit(EXIT_FAILURE);
+	}
+	do {
+		while ((n = read(c->pipe_fd, ibuf, CODEC_BUFSZ)) < 0 && errno == EINTR)
+			;
+		if (n < 0) {
+			perror("could not read from compressor pipe");
+			exit(EXIT_FAILURE);
+		}
+		z.next_in  = ibuf;
+		z.avail_in = n;
+		flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+		do {
+			z.next_out  = obuf;
+			z.avail_out = CODEC_BUFSZ;
+			(void) deflate(&z, flush);
+			codec_write(c->out_fd, obuf, CODEC_BUFSZ - z.avail_out);
+		} while (z.avail_out == 0);
+	} while (flush != Z_FINISH);
+	deflateEnd(&z);
+}
+#else
+static void
+gzip_decompress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	(void) c; (void) ibuf; (void) obuf;
+	codec_unsupported("gzip");
+}
+
+static void
+gzip_compress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	(void) c; (void) ibuf; (void) obuf;
+	codec_unsupported("gzip");
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/** Decompress the input into the pipe, following concatenated frames */
+static void
+zstd_decompress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	ZSTD_DCtx* d = ZSTD_createDCtx();
+	ZSTD_inBuffer zin = { ibuf, 0, 0 };
+	ZSTD_outBuffer zout;
+	size_t r = 0;
+
+	if (! d) {
+		fprintf(stderr, "could not initialize zstd\n");
+		exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		if (zin.pos == zin.size) {
+			zin.pos  = 0;
+			zin.size = codec_read(c, ibuf, CODEC_BUFSZ);
+			if (zin.size == 0)
+				break;
+		}
+		zout.dst  = obuf;
+		zout.size = CODEC_BUFSZ;
+		zout.pos  = 0;
+		r = ZSTD_decompressStream(d, &zout, &zin);
+		if (ZSTD_isError(r)) {
+			fprintf(stderr, "corrupt zstd input: %s\n"
+			       , ZSTD_getErrorName(r));
+			ZSTD_freeDCtx(d);
+			c->failed = 1;
+			return;
+		}
+		codec_write(c->pipe_fd, obuf, zout.pos);
+	}
+	if (r != 0) {
+		fprintf(stderr, "zstd input ends early\n");
+		c->failed = 1;
+	}
+	ZSTD_freeDCtx(d);
+}
+
+/** Compress the pipe into the output, with c->threads workers */
+static void
+zstd_compress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	ZSTD_CCtx* z = ZSTD_createCCtx();
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	ZSTD_EndDirective mode;
+	size_t r;
+	ssize_t n;
+
+	if (! z) {
+		fprintf(stderr, "could not initialize zstd\n");
+		exit(EXIT_FAILURE);
+	}
+	if (c->level >= 0)
+		(void) ZSTD_CCtx_setParameter(z, ZSTD_c_compressionLevel, c->level);
+	/* Fails, and compresses on this thread, without libzstd threads */
+	(void) ZSTD_CCtx_setParameter(z, ZSTD_c_nbWorkers, c->threads);
+	do {
+		while ((n = read(c->pipe_fd, ibuf, CODEC_BUFSZ)) < 0 && errno == EINTR)
+			;
+		if (n < 0) {
+			perror("could not read from compressor pipe");
+			exit(EXIT_FAILURE);
+		}
+		zin.src  = ibuf;
+		zin.size = n;
+		zin.pos  = 0;
+		mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+		do {
+			zout.dst  = obuf;
+			zout.size = CODEC_BUFSZ;
+			zout.pos  = 0;
+			r = ZSTD_compressStream2(z, &zout, &zin, mode);
+			if (ZSTD_isError(r)) {
+				fprintf(stderr, "zstd compression failed: %s\n"
+				       , ZSTD_getErrorName(r));
+				exit(EXIT_FAILURE);
+			}
+			codec_write(c->out_fd, obuf, zout.pos);
+		} while (mode == ZSTD_e_end ? r != 0 : zin.pos < zin.size);
+	} while (mode != ZSTD_e_end);
+	ZSTD_freeCCtx(z);
+}
+#else
+static void
+zstd_decompress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	(void) c; (void) ibuf; (void) obuf;
+	codec_unsupported("zstd");
+}
+
+static void
+zstd_compress(codec_t* c, uint8_t* ibuf, uint8_t* obuf)
+{
+	(void) c; (void) ibuf; (void) obuf;
+	codec_unsupported("zstd");
+}
+#endif
+
+void *
+codec_thread(void* arg)
+{
+	codec_t* c = arg;
+	uint8_t* ibuf = malloc(CODEC_BUFSZ);
+	uint8_t* obuf = malloc(CODEC_BUFSZ);
+
+	if (! ibuf || ! obuf) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (c->in) {
+		if (c->method == COMPRESS_GZIP)
+			gzip_decompress(c, ibuf, obuf);
+		else
+			zstd_decompress(c, ibuf, obuf);
+	} else {
+		if (c->method == COMPRESS_GZIP)
+			gzip_compress(c, ibuf, obuf);
+		else
+			zstd_compress(c, ibuf, obuf);
+	}
+	/* End of stream for the packet loop, or its pipe end is closed */
+	close(c->pipe_fd);
+	free(ibuf);
+	free(obuf);
+	return NULL;
+}
+
+static codec_t*
+codec_start(codec_t* c)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		perror("could not create pipe");
+		exit(EXIT_FAILURE);
+	}
+#ifdef F_SETPIPE_SZ
+	(void) fcntl(fds[0], F_SETPIPE_SZ, CODEC_BUFSZ);
+#endif
+	c->fd      = c->in ? fds[0] : fds[1];
+	c->pipe_fd = c->in ? fds[1] : fds[0];
+	if (pthread_create(&c->thread, NULL, codec_thread, c)) {
+		fprintf(stderr, "could not start codec thread\n");
+		exit(EXIT_FAILURE);
+	}
+	return c;
+}
+
+/*
+ * Decompress in, of which head_len bytes in head were read already, on a
+ * thread. The decompressed data is read from the returned codec's fd.
+ */
+codec_t*
+decompress_start(int method, FILE* in, const void* head, size_t head_len)
+{
+	codec_t* c = calloc(1, sizeof(codec_t));
+
+	if (! c) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	c->method = method;
+	c->in = in;
+	memcpy(c->head, head, head_len);
+	c->head_len = head_len;
+	return codec_start(c);
+}
+
+/*
+ * Compress what is written to the returned codec's fd to out_fd on a
+ * thread, at level (-1 for the default) with zstd using threads workers.
+ */
+codec_t*
+compress_start(int method, int out_fd, int level, int threads)
+{
+	codec_t* c = calloc(1, sizeof(codec_t));
+
+	if (! c) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	c->method  = method;
+	c->out_fd  = out_fd;
+	c->level   = level;
+	c->threads = threads;
+	return codec_start(c);
+}
+
+/*
+ * Wait for the codec to finish; the packet loop must have closed its
+ * end of the pipe (for output) or read all of it (for input). Returns
+ * whether the input failed to decompress to its end.
+ */
+int
+codec_finish(codec_t* c)
+{
+	int failed;
+
+	if (! c)
+		return 0;
+	pthread_join(c->thread, NULL);
+	failed = c->failed;
+	free(c);
+	return failed;
+}
+
+/*
+ * Keyed, prefix-preserving anonymization (Crypto-PAn, Xu et al.). Bit i
+ * of the anonymized address is bit i of the original, flipped by the
+ * first bit of the AES encryption of a block made of the original's
+ * first i bits followed by a secret pad. Needs no state, so it uses
+ * constant memory and gives the same result across runs, threads and
+ * machines that share the key.
+ *
+ * The encryptions for all bit positions of an address are independent,
+ * and are pipelined through AES-NI eight blocks at a time when the CPU
+ * has it. Otherwise a plain C AES is used.
+ */
+typedef struct cryptopan_t cryptopan_t;
+struct cryptopan_t {
+	/** AES-128 round keys */
+	uint8_t      rk[11][16];
+	/** Encrypted second half of the key */
+	uint8_t      pad[16];
+	/** Use AES-NI */
+	int          aesni;
+	/** Encode the roles as the table based mapping does */
+	int          roles;
+};
+
+cryptopan_t* cryptopan = NULL;
+
+static uint8_t aes_sbox[256];
+
+#define ROTL8(x, shift) ((uint8_t) ((x) << (shift) | (x) >> (8 - (shift))))
+
+/** Compute the AES S-box from the multiplicative inverses in GF(2^8) */
+void aes_init_sbox(void)
+{
+	uint8_t p = 1, q = 1;
+
+	do {
+		/* multiply p by 3 */
+		p = p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0);
+		/* divide q by 3 */
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		q ^= q & 0x80 ? 0x09 : 0;
+		/* affine transformation */
+		aes_sbox[p] = 0x63 ^ q ^ ROTL8(q, 1) ^ ROTL8(q, 2)
+		                       ^ ROTL8(q, 3) ^ ROTL8(q, 4);
+	} while (p != 1);
+	aes_sbox[0] = 0x63;
+}
+
+void aes128_expand_key(const uint8_t key[16], uint8_t rk[11][16])
+{
+	uint8_t rcon = 1;
+	int i, j;
+
+	memcpy(rk[0], key, 16);
+	for (i = 1; i < 11; i++) {
+		rk[i][0] = rk[i - 1][0] ^ aes_sbox[rk[i - 1][13]] ^ rcon;
+		rk[i][1] = rk[i - 1][1] ^ aes_sbox[rk[i - 1][14]];
+		rk[i][2] = rk[i - 1][2] ^ aes_sbox[rk[i - 1][15]];
+		rk[i][3] = rk[i - 1][3] ^ aes_sbox[rk[i - 1][12]];
+		for (j = 4; j < 16; j++)
+			rk[i][j] = rk[i - 1][j] ^ rk[i][j - 4];
+		rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0);
+	}
+}
+
+#define AES_XTIME(x) ((uint8_t) ((x) << 1 ^ ((x) & 0x80 ? 0x1b : 0)))
+
+void aes128_encrypt(const uint8_t rk[11][16], const uint8_t in[16],
+	uint8_t out[16])
+{
+	uint8_t s[16], t[16], a, b, c, d, e;
+	int round, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ rk[0][i];
+	for (round = 1; round < 11; round++) {
+		/* SubBytes and ShiftRows */
+		for (i = 0; i < 16; i++)
+			t[i] = aes_sbox[s[(i + 4 * (i & 3)) & 15]];
+		if (round < 10) {
+			/* MixColumns */
+			for (i = 0; i < 16; i += 4) {
+				a = t[i]; b = t[i + 1]; c = t[i + 2]; d = t[i + 3];
+				e = a ^ b ^ c ^ d;
+				t[i]     ^= e ^ AES_XTIME(a ^ b);
+				t[i + 1] ^= e ^ AES_XTIME(b ^ c);
+				t[i + 2] ^= e ^ AES_XTIME(c ^ d);
+				t[i + 3] ^= e ^ AES_XTIME(d ^ a);
+			}
+		}
+		for (i = 0; i < 16; i++)
+			s[i] = t[i] ^ rk[round][i];
+	}
+	memcpy(out, s, 16);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+
+#define AESNI_ROUNDS(op, k) \
+	b0 = op(b0, k); b1 = op(b1, k); b2 = op(b2, k); b3 = op(b3, k); \
+	b4 = op(b4, k); b5 = op(b5, k); b6 = op(b6, k); b7 = op(b7, k);
+
+/** Encrypt n blocks in place, eight at a time to fill the AES pipeline */
+__attribute__((target("aes,sse2")))
+void aes128_encrypt_blocks_aesni(const uint8_t rk[11][16],
+	uint8_t (*blocks)[16], size_t n)
+{
+	__m128i k[11], b0, b1, b2, b3, b4, b5, b6, b7;
+	size_t i;
+	int r;
+
+	for (r = 0; r < 11; r++)
+		k[r] = _mm_loadu_si128((const __m128i *)rk[r]);
+	for (i = 0; i + 8 <= n; i += 8) {
+		b0 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i    ]), k[0]);
+		b1 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 1]), k[0]);
+		b2 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 2]), k[0]);
+		b3 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 3]), k[0]);
+		b4 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 4]), k[0]);
+		b5 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 5]), k[0]);
+		b6 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 6]), k[0]);
+		b7 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i + 7]), k[0]);
+		for (r = 1; r < 10; r++) {
+			AESNI_ROUNDS(_mm_aesenc_si128, k[r])
+		}
+		AESNI_ROUNDS(_mm_aesenclast_si128, k[10])
+		_mm_storeu_si128((__m128i *)blocks[i    ], b0);
+		_mm_storeu_si128((__m128i *)blocks[i + 1], b1);
+		_mm_storeu_si128((__m128i *)blocks[i + 2], b2);
+		_mm_storeu_si128((__m128i *)blocks[i + 3], b3);
+		_mm_storeu_si128((__m128i *)blocks[i + 4], b4);
+		_mm_storeu_si128((__m128i *)blocks[i + 5], b5);
+		_mm_storeu_si128((__m128i *)blocks[i + 6], b6);
+		_mm_storeu_si128((__m128i *)blocks[i + 7], b7);
+	}
+	for (; i < n; i++) {
+		b0 = _mm_xor_si128(_mm_loadu_si128((__m128i *)blocks[i]), k[0]);
+		for (r = 1; r < 10; r++)
+			b0 = _mm_aesenc_si128(b0, k[r]);
+		b0 = _mm_aesenclast_si128(b0, k[10]);
+		_mm_storeu_si128((__m128i *)blocks[i], b0);
+	}
+}
+#endif
+
+static inline void
+cryptopan_encrypt_blocks(const cryptopan_t* cp, uint8_t (*blocks)[16],
+	size_t n)
+{
+	size_t i;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (cp->aesni) {
+		aes128_encrypt_blocks_aesni(cp->rk, blocks, n);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		aes128_encrypt(cp->rk, blocks[i], blocks[i]);
+}
+
+/** Anonymize the len (4 or 16) byte address addr in place */
+void cryptopan_anonymize(const cryptopan_t* cp, uint8_t* addr, size_t len)
+{
+	uint8_t blocks[128][16];
+	uint8_t flip[16];
+	size_t pos, bytes, bits, n = len * 8;
+
+	/* Block pos holds the first pos bits of addr, then the pad */
+	for (pos = 0; pos < n; pos++) {
+		bytes = pos / 8;
+		bits  = pos % 8;
+		memcpy(blocks[pos], addr, bytes);
+		memcpy(blocks[pos] + bytes, cp->pad + bytes, 16 - bytes);
+		if (bits)
+			blocks[pos][bytes] = (addr[bytes] & (0xff << (8 - bits)))
+			                   | (cp->pad[bytes] & (0xff >> bits));
+	}
+	cryptopan_encrypt_blocks(cp, blocks, n);
+
+	memset(flip, 0, len);
+	for (pos = 0; pos < n; pos++)
+		flip[pos / 8] |= (blocks[pos][0] >> 7) << (7 - pos % 8);
+	for (pos = 0; pos < len; pos++)
+		addr[pos] ^= flip[pos];
+}
+
+/*
+ * Create a Crypto-PAn context from a 32 byte key: an AES key followed by
+ * the pad secret.
+ */
+cryptopan_t* cryptopan_create(const uint8_t key[32], int roles)
+{
+	cryptopan_t* cp = calloc(1, sizeof(cryptopan_t));
+
+	if (! cp) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	aes_init_sbox();
+	aes128_expand_key(key, cp->rk);
+	aes128_encrypt(cp->rk, key + 16, cp->pad);
+#if defined(__x86_64__) || defined(__i386__)
+	cp->aesni = __builtin_cpu_supports("aes");
+#endif
+	cp->roles = roles;
+	return cp;
+}
+
+/*
+ * Read a Crypto-PAn key from fn: 32 raw bytes, or 64 hexadecimal digits
+ * (whitespace is ignored).
+ */
+void cryptopan_read_key(const char* fn, uint8_t key[32])
+{
+	uint8_t buf[256];
+	size_t n, i, j;
+	FILE* fp;
+	int c;
+
+	if (! (fp = fopen(fn, "r"))) {
+		perror("could not open key file");
+		exit(EXIT_FAILURE);
+	}
+	n = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+	if (n == 32) {
+		memcpy(key, buf, 32);
+		return;
+	}
+	for (i = j = 0; i < n && j < 64; i++) {
+		c = buf[i];
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+			continue;
+		if      (c >= '0' && c <= '9') c -= '0';
+		else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+		else break;
+		if (j % 2)
+			key[j / 2] |= c;
+		else
+			key[j / 2] = c << 4;
+		j++;
+	}
+	for (; i < n; i++)
+		if (buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\n'
+		&&  buf[i] != '\r')
+			break;
+	if (j != 64 || i != n) {
+		fprintf(stderr, "%s: key must be 32 bytes or 64 hex digits\n", fn);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Crypto-PAn counterpart of lookup_and_replace4 */
+void cryptopan_replace4(uint8_t* ipv4, uint16_t ipv4type)
+{
+	cryptopan_anonymize(cryptopan, ipv4, 4);
+	if (cryptopan->roles) {
+		if (ipv4type == 2)
+			ipv4[0] |= 0x80;
+		else
+			ipv4[0] &= 0x7f;
+	}
+}
+
+/** Crypto-PAn counterpart of lookup_and_replace6 */
+void cryptopan_replace6(uint8_t* ipv6, uint16_t ipv6type)
+{
+	cryptopan_anonymize(cryptopan, ipv6, 16);
+	if (cryptopan->roles) {
+		ipv6[6] = (ipv6type & 15) << 4 | (ipv6type & 15);
+		ipv6[7] = ipv6[6];
+	}
+}
+
+/*
+ * Persistent mapping state. The state file holds the id counters and
+ * the three tables in the slot layout of addrmap_t, each at a page
+ * aligned offset, so the hash tables can be mapped from the file as
+ * they are. Loading takes one linear pass over the slots to validate
+ * them, but inserts nothing entry by entry. The file is in host byte
+ * order. With --epoch it records the epoch of the
+ * tables too, which are then only used in that epoch.
+ */
+#define STATE_MAGIC   0x53414e44	/* "DNAS" */
+#define STATE_VERSION 1
+#define STATE_ALIGN   4096
+
+struct state_table {
+	uint64_t offset;
+	uint64_t capacity;
+	uint64_t count;
+};
+
+struct state_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_ipv4nodes;
+	uint32_t n_ipv6nets;
+	uint32_t n_ipv6nodes;
+	uint32_t keylens;	/* 4 << 16 | 6 << 8 | 16, as a layout check */
+	/** ipv4nodes, ipv6nets and ipv6nodes */
+	struct state_table tables[3];
+	/** With --epoch, its length and the end of the epoch of the tables,
+	 *  0 in files from before these were added */
+	uint64_t epoch_secs;
+	uint64_t epoch_end;
+};
+
+#define STATE_KEYLENS (4 << 16 | 6 << 8 | 16)
+
+/** The state file mapping, while the hash tables point into it */
+uint8_t* state_map = NULL;
+size_t   state_map_size = 0;
+
+/** The key compare of the tree state_load_table sorts nodes for */
+int (*state_sort_cmp)(const void*, const void*) = NULL;
+
+int state_node_cmp(const void* node1, const void* node2)
+{
+	return state_sort_cmp( (*(rbnode_t* const*)node1)->key
+	                     , (*(rbnode_t* const*)node2)->key);
+}
+
+/*
+ * Insert the entries of a state table into the configured table. A tree
+ * is built from the sorted entries in one go, rather than rebalanced
+ * after inserting each of them.
+ */
+void state_load_table(const uint8_t* slots, size_t capacity, size_t keylen,
+	int table)
+{
+	rbtree_t* trees[3] = { ipv4nodes, ipv6nets, ipv6nodes };
+	size_t slotsize = addrmap_slotsize(keylen);
+	const uint8_t* slot;
+	rbnode_t** nodes;
+	rbtree_t loaded;
+	uint32_t value;
+	size_t i, j, n = 0;
+
+	if (table == 0 && ipv4_backend == MAP_DIRECT) {
+		for (i = 0; i < capacity; i++) {
+			slot = slots + i * slotsize;
+			if ((value = *(const uint32_t *)slot))
+				ipv4direct_insert( ipv4nodes_direct, slot + 4
+				                 , value - 1);
+		}
+		return;
+	}
+	if (! (nodes = malloc(capacity * sizeof(rbnode_t*)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < capacity; i++) {
+		slot = slots + i * slotsize;
+		if (! (value = *(const uint32_t *)slot))
+			continue;
+		nodes[n] = arena_alloc(&node_arena, sizeof(rbnode_t));
+		memcpy(nodes[n]->key, slot + 4, keylen);
+		nodes[n++]->value = value - 1;
+	}
+	state_sort_cmp = trees[table]->cmp;
+	qsort(nodes, n, sizeof(rbnode_t*), state_node_cmp);
+	/* A key twice would break the tree, keep one of them */
+	for (i = j = 0; i < n; i++)
+		if (j == 0 || state_node_cmp(&nodes[j - 1], &nodes[i]))
+			nodes[j++] = nodes[i];
+
+	rbtree_init(&loaded, trees[table]->cmp);
+	rbtree_build(&loaded, nodes, j);
+	rbtree_join(trees[table], &loaded);
+	free(nodes);
+}
+
+/*
+ * Whether the slots of a state table hold count entries, with ids below
+ * counter. The mapping tables are used as they are, and lookups in a
+ * table without empty slots would probe forever.
+ */
+int state_check_table(const uint8_t* slots, size_t capacity, size_t keylen,
+	uint64_t count, uint32_t counter)
+{
+	size_t slotsize = addrmap_slotsize(keylen);
+	uint32_t value;
+	uint64_t n = 0;
+	size_t i;
+
+	for (i = 0; i < capacity; i++) {
+		if (! (value = *(const uint32_t *)(slots + i * slotsize)))
+			continue;
+		if (value - 1 >= counter)
+			return 0;
+		n++;
+	}
+	return n == count;
+}
+
+/*
+ * Load the state from fn into the (empty) tables. Returns 0 when fn does
+ * not exist yet, or with --epoch when it holds no tables of an epoch of
+ * this length, 1 when loaded. Loaded tables of an epoch make it the
+ * current one.
+ */
+int state_load(const char* fn)
+{
+	struct state_header hdr;
+	struct stat st;
+	addrmap_t* hash[3] = { ipv4nodes_hash, ipv6nets_hash, ipv6nodes_hash };
+	size_t keylens[3] = { 4, 6, 16 };
+	uint32_t counters[3];
+	int fd, i;
+
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		perror("could not open state");
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr)) {
+		fprintf(stderr, "%s: not a state file\n", fn);
+		exit(EXIT_FAILURE);
+	}
+	state_map_size = st.st_size;
+	state_map = mmap( NULL, state_map_size, PROT_READ | PROT_WRITE
+	                , MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (state_map == MAP_FAILED) {
+		perror("could not map state");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&hdr, state_map, sizeof(hdr));
+	if (hdr.magic != STATE_MAGIC || hdr.version != STATE_VERSION
+	||  hdr.keylens != STATE_KEYLENS) {
+		fprintf(stderr, "%s: not a state file of this version "
+		                "or byte order\n", fn);
+		exit(EXIT_FAILURE);
+	}
+	if (epoch_secs && ( hdr.epoch_secs != epoch_secs || ! hdr.epoch_end
+	                  || hdr.epoch_end % epoch_secs)) {
+		/* The mappings of another epoch must not be reused */
+		fprintf(stderr, "%s: holds no tables of %" PRIu32 " second "
+		                "epochs, starting with empty tables\n"
+		              , fn, epoch_secs);
+		munmap(state_map, state_map_size);
+		state_map = NULL;
+		return 0;
+	}
+	counters[0] = hdr.n_ipv4nodes;
+	counters[1] = hdr.n_ipv6nets;
+	counters[2] = hdr.n_ipv6nodes;
+	for (i = 0; i < 3; i++) {
+		if (hdr.tables[i].capacity == 0
+		||  hdr.tables[i].capacity & (hdr.tables[i].capacity - 1)
+		||  hdr.tables[i].offset % STATE_ALIGN
+		||  hdr.tables[i].offset > state_map_size
+		||  hdr.tables[i].capacity > ( state_map_size
+		                             - hdr.tables[i].offset)
+		                             / addrmap_slotsize(keylens[i])
+		||  hdr.tables[i].count >= hdr.tables[i].capacity
+		||  hdr.tables[i].count * 10 >= hdr.tables[i].capacity * 7
+		||  ! state_check_table( state_map + hdr.tables[i].offset
+		                       , hdr.tables[i].capacity, keylens[i]
+		                       , hdr.tables[i].count, counters[i])) {
+			fprintf(stderr, "%s: corrupt state file\n", fn);
+			exit(EXIT_FAILURE);
+		}
+	}
+	n_ipv4nodes = hdr.n_ipv4nodes;
+	n_ipv6nets  = hdr.n_ipv6nets;
+	n_ipv6nodes = hdr.n_ipv6nodes;
+	if (epoch_secs) {
+		/* Go on in the epoch of the tables, packets past its end
+		 * start the next one as usual */
+		epoch_end = hdr.epoch_end;
+		if (epoch_tagging)
+			epoch_tag = (uint32_t)(epoch_end / epoch_secs - 1);
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (i == 0 ? ipv4_backend == MAP_HASH : map_backend == MAP_HASH) {
+			/* Use the slots in the mapping as they are */
+			if (hash[i]->spill)
+				hash[i]->spill->table_bytes +=
+				    hdr.tables[i].capacity * hash[i]->slotsize
+				  - addrmap_footprint(hash[i]);
+			free(hash[i]->slots);
+			hash[i]->slots    = state_map + hdr.tables[i].offset;
+			hash[i]->capacity = hdr.tables[i].capacity;
+			hash[i]->count    = hdr.tables[i].count;
+			hash[i]->mapped   = 1;
+		} else {
+			state_load_table( state_map + hdr.tables[i].offset
+			                , hdr.tables[i].capacity, keylens[i], i);
+		}
+	}
+	return 1;
+}
+
+/** Copy a tree into a new hash map for saving */
+addrmap_t* state_rbtree_addrmap(rbtree_t* rbtree, size_t keylen)
+{
+	addrmap_t* map = addrmap_create(keylen);
+	rbnode_t* node;
+
+	for (node = rbtree_first(rbtree); node != RBTREE_NULL;
+	     node = rbtree_next(node))
+		addrmap_insert(map, node->key, keylen, node->value);
+	return map;
+}
+
+/*
+ * Copy a hash map and the entries it evicted into a new hash map for
+ * saving. When entries were evicted its slots are in a spill file as
+ * well, as the whole of it would not keep to the budget.
+ */
+addrmap_t* state_spill_addrmap(addrmap_t* from)
+{
+	addrmap_t* map = malloc(sizeof(addrmap_t));
+	spill_t* spill = from->spill;
+	uint8_t* slot;
+	size_t i;
+
+	if (! map) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	map->keylen   = from->keylen;
+	map->slotsize = from->slotsize;
+	map->count    = 0;
+	map->spill    = NULL;
+	map->hand     = 0;
+	/* Big enough for both, so that it never grows */
+	map->capacity = ADDRMAP_INITIAL_CAPACITY;
+	while ((from->count + spill->count + 1) * 10 > map->capacity * 7)
+		map->capacity *= 2;
+	if (spill->count) {
+		map->slots  = spill_map(addrmap_footprint(map));
+		map->mapped = 1;
+	} else {
+		/* Nothing was evicted, so it all fits in memory */
+		map->slots  = calloc(map->capacity, map->slotsize);
+		map->mapped = 0;
+		if (! map->slots) {
+			fprintf(stderr, "mem allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < from->capacity; i++) {
+		slot = from->slots + i * from->slotsize;
+		if (*(uint32_t *)slot)
+			addrmap_insert( map, slot + 4, map->keylen
+			              , (*(uint32_t *)slot & ~ADDRMAP_REF) - 1);
+	}
+	for (i = 0; i < spill->capacity; i++) {
+		slot = spill->slots + i * SPILL_SLOT_SIZE;
+		if (*(uint32_t *)slot && slot[4] == map->keylen)
+			addrmap_insert( map, slot + 8, map->keylen
+			              , *(uint32_t *)slot - 1);
+	}
+	return map;
+}
+
+/** Copy the direct IPv4 table into a new hash map for saving */
+addrmap_t* state_ipv4direct_addrmap(ipv4direct_t* table)
+{
+	addrmap_t* map = addrmap_create(4);
+	uint8_t key[4];
+	uint32_t hi, lo;
+
+	for (hi = 0; hi < 65536; hi++) {
+		if (! table->pages[hi])
+			continue;
+		for (lo = 0; lo < IPV4DIRECT_PAGE_ENTRIES; lo++) {
+			if (! table->pages[hi][lo])
+				continue;
+			key[0] = hi >> 8; key[1] = hi & 0xff;
+			key[2] = lo >> 8; key[3] = lo & 0xff;
+			addrmap_insert(map, key, 4, table->pages[hi][lo] - 1);
+		}
+	}
+	return map;
+}
+
+void state_write(int fd, const void* data, size_t len, const char* fn)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, data, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "could not write state %s: %s\n"
+			       , fn, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		data = (const uint8_t *)data + n;
+		len -= n;
+	}
+}
+
+/** Save the state to fn, through a temporary file and a rename */
+void state_save(const char* fn)
+{
+	struct state_header hdr;
+	addrmap_t* maps[3];
+	static const uint8_t zeros[STATE_ALIGN];
+	char* tmp_fn;
+	uint64_t off;
+	int fd, i;
+
+	maps[0] = ipv4_backend == MAP_HASH   ? ipv4nodes_hash
+	        : ipv4_backend == MAP_DIRECT ? state_ipv4direct_addrmap(ipv4nodes_direct)
+	        : state_rbtree_addrmap(ipv4nodes, 4);
+	maps[1] = map_backend == MAP_HASH ? ipv6nets_hash
+	        : state_rbtree_addrmap(ipv6nets, 6);
+	maps[2] = map_backend == MAP_HASH ? ipv6nodes_hash
+	        : state_rbtree_addrmap(ipv6nodes, 16);
+	for (i = 0; i < 3; i++)
+		if (maps[i]->spill)
+			maps[i] = state_spill_addrmap(maps[i]);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic       = STATE_MAGIC;
+	hdr.version     = STATE_VERSION;
+	hdr.n_ipv4nodes = n_ipv4nodes;
+	hdr.n_ipv6nets  = n_ipv6nets;
+	hdr.n_ipv6nodes = n_ipv6nodes;
+	hdr.keylens     = STATE_KEYLENS;
+	hdr.epoch_secs  = epoch_secs;
+	hdr.epoch_end   = epoch_end;
+	off = STATE_ALIGN;
+	for (i = 0; i < 3; i++) {
+		hdr.tables[i].offset   = off;
+		hdr.tables[i].capacity = maps[i]->capacity;
+		hdr.tables[i].count    = maps[i]->count;
+		off += addrmap_footprint(maps[i]);
+		off = (off + STATE_ALIGN - 1) & ~(uint64_t)(STATE_ALIGN - 1);
+	}
+
+	if (! (tmp_fn = malloc(strlen(fn) + 5))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(tmp_fn, "%s.tmp", fn);
+	if ((fd = open(tmp_fn, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+		perror("could not create state");
+		exit(EXIT_FAILURE);
+	}
+	state_write(fd, &hdr, sizeof(hdr), tmp_fn);
+	state_write(fd, zeros, STATE_ALIGN - sizeof(hdr), tmp_fn);
+	for (i = 0; i < 3; i++) {
+		off = addrmap_footprint(maps[i]);
+		state_write(fd, maps[i]->slots, off, tmp_fn);
+		if (off % STATE_ALIGN)
+			state_write( fd, zeros, STATE_ALIGN - off % STATE_ALIGN
+			           , tmp_fn);
+	}
+	if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp_fn, fn) < 0) {
+		fprintf(stderr, "could not save state %s: %s\n"
+		       , fn, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(tmp_fn);
+	for (i = 0; i < 3; i++) {
+		if (maps[i] == ipv4nodes_hash || maps[i] == ipv6nets_hash
+		||  maps[i] == ipv6nodes_hash)
+			continue;
+		/* Only the copies of maps with a spill are mapped */
+		if (maps[i]->mapped)
+			munmap(maps[i]->slots, addrmap_footprint(maps[i]));
+		addrmap_free(maps[i]);
+	}
+}
+
+/*
+ * Packet counters. They are kept per class of packet and reported in
+ * rate limited progress lines and in a JSON summary at exit.
+ */
+#define STAT_OTHER      0	/* not IPv4 or IPv6 */
+#define STAT_IPV4_UDP   1
+#define STAT_IPV4_TCP   2
+#define STAT_IPV4_ICMP  3
+#define STAT_IPV4_OTHER 4
+#define STAT_IPV6_UDP   5
+#define STAT_IPV6_TCP   6
+#define STAT_IPV6_ICMP  7
+#define STAT_IPV6_FRAG  8
+#define STAT_IPV6_OTHER 9
+#define STAT_N_CLASSES 10
+
+static const char* stat_class_names[STAT_N_CLASSES] = {
+	"other", "ipv4_udp", "ipv4_tcp", "ipv4_icmp", "ipv4_other",
+	"ipv6_udp", "ipv6_tcp", "ipv6_icmp", "ipv6_frag", "ipv6_other"
+};
+
+/** The progress clock is only looked at once every this many packets */
+#define STATS_CHECK_MASK 0x3fff
+
+typedef struct stats_t stats_t;
+struct stats_t {
+	uint64_t     pkts_read;
+	uint64_t     bytes_read;
+	uint64_t     pkts_written;
+	uint64_t     bytes_written;
+	/** Packets too short to reach the headers to anonymize */
+	uint64_t     pkts_short;
+	/** Packets at the end of the input with a caplen beyond it */
+	uint64_t     pkts_truncated;
+	/** Packets the kernel dropped (live capture) */
+	uint64_t     pkts_dropped;
+	/** Packets looked up in, and found in the flow cache */
+	uint64_t     flow_lookups;
+	uint64_t     flow_hits;
+	/** Tables swapped for those of a new epoch */
+	uint64_t     epochs;
+	uint64_t     written[STAT_N_CLASSES];
+	uint64_t     skipped[STAT_N_CLASSES];
+
+	struct timespec start;
+	/** Seconds between progress lines, 0 for none */
+	double       progress_interval;
+	double       last_progress;
+	uint64_t     last_pkts;
+	uint64_t     last_bytes;
+	uint64_t     last_addrs;
+};
+
+_Thread_local stats_t stats;
+
+static inline double
+stats_elapsed(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - stats.start.tv_sec)
+	     + (now.tv_nsec - stats.start.tv_nsec) / 1e9;
+}
+
+void
+stats_init(double progress_interval)
+{
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	stats.progress_interval = progress_interval;
+}
+
+/** Total number of addresses in the mapping tables */
+static inline uint64_t
+stats_addrs(void)
+{
+	return (uint64_t)n_ipv4nodes + n_ipv6nodes;
+}
+
+void
+stats_progress(void)
+{
+	double   elapsed = stats_elapsed();
+	double   dt = elapsed - stats.last_progress;
+
+	if (dt < stats.progress_interval)
+		return;
+	fprintf( stderr
+	       , "%.1fs: %" PRIu64 " pkts read, %" PRIu64 " written"
+	         ", %.0f pkts/s, %.1f MB/s"
+	         ", ipv4 %" PRIu32 " ipv6 %" PRIu32 "/%" PRIu32
+	         ", %.0f new addrs/s\n"
+	       , elapsed, stats.pkts_read, stats.pkts_written
+	       , (stats.pkts_read - stats.last_pkts) / dt
+	       , (stats.bytes_read - stats.last_bytes) / dt / 1e6
+	       , n_ipv4nodes, n_ipv6nets, n_ipv6nodes
+	       , (stats_addrs() - stats.last_addrs) / dt);
+	stats.last_progress = elapsed;
+	stats.last_pkts  = stats.pkts_read;
+	stats.last_bytes = stats.bytes_read;
+	stats.last_addrs = stats_addrs();
+}
+
+/** Count a packet record of len bytes and class cls, that was written or skipped */
+static inline void
+stats_packet(int cls, size_t len, int written)
+{
+	stats.pkts_read++;
+	stats.bytes_read += len;
+	if (written) {
+		stats.pkts_written++;
+		stats.bytes_written += len;
+		stats.written[cls]++;
+	} else
+		stats.skipped[cls]++;
+
+	if ((stats.pkts_read & STATS_CHECK_MASK) == 0
+	&&  stats.progress_interval > 0)
+		stats_progress();
+}
+
+/** Write the counters and table sizes as a JSON object */
+void
+stats_json(FILE* fp)
+{
+	double elapsed = stats_elapsed();
+	struct rusage ru;
+	int i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"elapsed\": %.6f,\n", elapsed);
+	fprintf(fp, "  \"pkts_read\": %" PRIu64 ",\n", stats.pkts_read);
+	fprintf(fp, "  \"bytes_read\": %" PRIu64 ",\n", stats.bytes_read);
+	fprintf(fp, "  \"pkts_written\": %" PRIu64 ",\n", stats.pkts_written);
+	fprintf(fp, "  \"bytes_written\": %" PRIu64 ",\n", stats.bytes_written);
+	fprintf(fp, "  \"pkts_short\": %" PRIu64 ",\n", stats.pkts_short);
+	fprintf(fp, "  \"pkts_truncated\": %" PRIu64 ",\n", stats.pkts_truncated);
+	fprintf(fp, "  \"pkts_dropped\": %" PRIu64 ",\n", stats.pkts_dropped);
+	fprintf(fp, "  \"pkts_per_sec\": %.0f,\n"
+	          , elapsed > 0 ? stats.pkts_read / elapsed : 0);
+	fprintf(fp, "  \"mbytes_per_sec\": %.3f,\n"
+	          , elapsed > 0 ? stats.bytes_read / elapsed / 1e6 : 0);
+	fprintf(fp, "  \"classes\": {\n");
+	for (i = 0; i < STAT_N_CLASSES; i++)
+		fprintf( fp, "    \"%s\": { \"written\": %" PRIu64
+		             ", \"skipped\": %" PRIu64 " }%s\n"
+		       , stat_class_names[i]
+		       , stats.written[i], stats.skipped[i]
+		       , i + 1 < STAT_N_CLASSES ? "," : "");
+	fprintf(fp, "  },\n");
+	fprintf(fp, "  \"tables\": {\n");
+	fprintf(fp, "    \"ipv4nodes\": %" PRIu32 ",\n", n_ipv4nodes);
+	fprintf(fp, "    \"ipv6nets\": %" PRIu32 ",\n", n_ipv6nets);
+	fprintf(fp, "    \"ipv6nodes\": %" PRIu32 "\n", n_ipv6nodes);
+	fprintf(fp, "  },\n");
+	fprintf(fp, "  \"epochs\": %" PRIu64 ",\n", stats.epochs);
+	fprintf(fp, "  \"flow_cache\": {\n");
+	fprintf(fp, "    \"lookups\": %" PRIu64 ",\n", stats.flow_lookups);
+	fprintf(fp, "    \"hits\": %" PRIu64 ",\n", stats.flow_hits);
+	fprintf(fp, "    \"hit_rate\": %.4f\n", stats.flow_lookups
+	          ? (double)stats.flow_hits / stats.flow_lookups : 0);
+	fprintf(fp, "  },\n");
+	fprintf(fp, "  \"memory\": {\n");
+	fprintf(fp, "    \"hash_bytes\": %zu,\n"
+	          , addrmap_footprint(ipv4nodes_hash)
+	          + addrmap_footprint(ipv6nets_hash)
+	          + addrmap_footprint(ipv6nodes_hash));
+	fprintf(fp, "    \"max_mem\": %zu,\n", max_mem);
+	fprintf(fp, "    \"evictions\": %" PRIu64 ",\n"
+	          , addr_spill ? addr_spill->evictions : 0);
+	fprintf(fp, "    \"spilled\": %zu,\n"
+	          , addr_spill ? addr_spill->count : 0);
+	fprintf(fp, "    \"spill_probes\": %" PRIu64 ",\n"
+	          , addr_spill ? addr_spill->probes : 0);
+	fprintf(fp, "    \"spill_faults\": %" PRIu64 ",\n"
+	          , addr_spill ? addr_spill->faults : 0);
+	fprintf(fp, "    \"spill_bytes\": %zu,\n", spill_footprint(addr_spill));
+	fprintf(fp, "    \"ipv4_direct_bytes\": %zu,\n"
+	          , ipv4nodes_direct ? ipv4direct_footprint(ipv4nodes_direct) : 0);
+	fprintf(fp, "    \"arena_nodes\": %zu,\n", node_arena.n_allocs);
+	fprintf(fp, "    \"arena_bytes_used\": %zu,\n", node_arena.n_bytes);
+	fprintf(fp, "    \"arena_bytes\": %zu,\n", arena_footprint(&node_arena));
+	fprintf(fp, "    \"peak_rss_kb\": %ld\n"
+	          , getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0L);
+	fprintf(fp, "  }\n");
+	fprintf(fp, "}\n");
+}
+
+/*
+ * The ports that make a UDP or TCP packet DNS, one bit per port, so
+ * whatever the set the test is a single load.
+ */
+static uint64_t dns_ports[65536 / 64] = { 1ULL << 53 };
+
+#define DNS_PORT(port) (dns_ports[(port) >> 6] >> ((port) & 63) & 1)
+
+/** Set dns_ports from a list like "53,853,5353,5300-5399" */
+static void
+dns_ports_parse(const char* list)
+{
+	const char* s = list;
+	char* end;
+	unsigned long lo, hi, port;
+
+	memset(dns_ports, 0, sizeof(dns_ports));
+	for (;;) {
+		lo = hi = strtoul(s, &end, 10);
+		if (end != s && *end == '-')
+			hi = strtoul((s = end + 1), &end, 10);
+		if (end == s || lo > hi || hi > 65535
+		||  (*end != ',' && *end != 0)) {
+			fprintf(stderr, "bad port list: %s\n", list);
+			exit(EXIT_FAILURE);
+		}
+		for (port = lo; port <= hi; port++)
+			dns_ports[port >> 6] |= 1ULL << (port & 63);
+		if (! *end)
+			break;
+		s = end + 1;
+	}
+}
+
+/** A size in bytes, with an optional K, M or G suffix */
+size_t
+size_parse(const char* arg)
+{
+	unsigned long long n;
+	char* end;
+
+	errno = 0;
+	n = strtoull(arg, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; end++; break;
+	case 'm': case 'M': n <<= 20; end++; break;
+	case 'g': case 'G': n <<= 30; end++; break;
+	}
+	if (errno || end == arg || *end || ! isdigit((unsigned char)*arg)) {
+		fprintf(stderr, "bad size: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return (size_t)n;
+}
+
+/** A number of seconds, with an optional m, h or d suffix */
+uint32_t
+secs_parse(const char* arg)
+{
+	unsigned long n;
+	char* end;
+
+	errno = 0;
+	n = strtoul(arg, &end, 10);
+	switch (*end) {
+	case 'm': n *= 60;    end++; break;
+	case 'h': n *= 3600;  end++; break;
+	case 'd': n *= 86400; end++; break;
+	}
+	if (errno || end == arg || *end || ! isdigit((unsigned char)*arg)
+	||  n == 0 || n > UINT32_MAX) {
+		fprintf(stderr, "bad number of seconds: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return (uint32_t)n;
+}
+
+/*
+ * Protocol filter. The expression is compiled at start up into the set
+ * of packet classes that it matches, so that applying it costs one bit
+ * test per packet:
+ *
+ *   expr   = term { ("or" | "||") term }
+ *   term   = factor { ("and" | "&&") factor }
+ *   factor = ("not" | "!") factor | "(" expr ")" | primitive
+ */
+#define CLASS(c) (1U << (c))
+#define CLASSES_IPV4 (CLASS(STAT_IPV4_UDP) | CLASS(STAT_IPV4_TCP) \
+                     | CLASS(STAT_IPV4_ICMP) | CLASS(STAT_IPV4_OTHER))
+#define CLASSES_IPV6 (CLASS(STAT_IPV6_UDP) | CLASS(STAT_IPV6_TCP) \
+                     | CLASS(STAT_IPV6_ICMP) | CLASS(STAT_IPV6_FRAG) \
+                     | CLASS(STAT_IPV6_OTHER))
+#define CLASSES_ALL (CLASS(STAT_N_CLASSES) - 1)
+
+static const struct {
+	const char*  name;
+	uint32_t     classes;
+} filter_primitives[] = {
+	{ "ip",    CLASSES_IPV4 },
+	{ "ip6",   CLASSES_IPV6 },
+	{ "udp",   CLASS(STAT_IPV4_UDP) | CLASS(STAT_IPV6_UDP) },
+	{ "tcp",   CLASS(STAT_IPV4_TCP) | CLASS(STAT_IPV6_TCP) },
+	{ "icmp",  CLASS(STAT_IPV4_ICMP) },
+	{ "icmp6", CLASS(STAT_IPV6_ICMP) },
+	{ "frag",  CLASS(STAT_IPV6_FRAG) }
+};
+
+/** The classes of packets that may be written */
+static uint32_t filter_classes = CLASSES_ALL;
+
+#define FILTER_PASSES(cls) (filter_classes >> (cls) & 1)
+
+typedef struct filter_parser_t filter_parser_t;
+struct filter_parser_t {
+	const char*  expr;
+	const char*  pos;
+	/** The current token, empty at the end */
+	char         tok[8];
+};
+
+static void
+filter_error(const filter_parser_t* fp)
+{
+	fprintf(stderr, "bad filter expression: %s\n", fp->expr);
+	exit(EXIT_FAILURE);
+}
+
+static void
+filter_next(filter_parser_t* fp)
+{
+	size_t n = 0;
+
+	while (*fp->pos == ' ' || *fp->pos == '\t')
+		fp->pos++;
+	if (*fp->pos && strchr("()!", *fp->pos))
+		fp->tok[n++] = *fp->pos++;
+
+	else if ((fp->pos[0] == '&' || fp->pos[0] == '|')
+	     &&  fp->pos[1] == fp->pos[0]) {
+		fp->tok[n++] = *fp->pos++;
+		fp->tok[n++] = *fp->pos++;
+	} else
+		while (isalnum((unsigned char)*fp->pos)) {
+			if (n == sizeof(fp->tok) - 1)
+				filter_error(fp);
+			fp->tok[n++] = *fp->pos++;
+		}
+	if (n == 0 && *fp->pos)
+		filter_error(fp);
+	fp->tok[n] = 0;
+}
+
+static uint32_t filter_expr(filter_parser_t* fp);
+
+static uint32_t
+filter_factor(filter_parser_t* fp)
+{
+	uint32_t classes;
+	size_t i;
+
+	if (! strcmp(fp->tok, "not") || ! strcmp(fp->tok, "!")) {
+		filter_next(fp);
+		return ~filter_factor(fp) & CLASSES_ALL;
+	}
+	if (! strcmp(fp->tok, "(")) {
+		filter_next(fp);
+		classes = filter_expr(fp);
+		if (strcmp(fp->tok, ")"))
+			filter_error(fp);
+		filter_next(fp);
+		return classes;
+	}
+	for (i = 0; i < sizeof(filter_primitives)
+	              / sizeof(filter_primitives[0]); i++)
+		if (! strcmp(fp->tok, filter_primitives[i].name)) {
+			filter_next(fp);
+			return filter_primitives[i].classes;
+		}
+	filter_error(fp);
+	return 0;
+}
+
+static uint32_t
+filter_term(filter_parser_t* fp)
+{
+	uint32_t classes = filter_factor(fp);
+
+	while (! strcmp(fp->tok, "and") || ! strcmp(fp->tok, "&&")) {
+		filter_next(fp);
+		classes &= filter_factor(fp);
+	}
+	return classes;
+}
+
+static uint32_t
+filter_expr(filter_parser_t* fp)
+{
+	uint32_t classes = filter_term(fp);
+
+	while (! strcmp(fp->tok, "or") || ! strcmp(fp->tok, "||")) {
+		filter_next(fp);
+		classes |= filter_term(fp);
+	}
+	return classes;
+}
+
+/** Compile expr into filter_classes */
+static void
+filter_compile(const char* expr)
+{
+	filter_parser_t fp;
+
+	fp.expr = fp.pos = expr;
+	filter_next(&fp);
+	filter_classes = filter_expr(&fp);
+	if (fp.tok[0])
+		filter_error(&fp);
+}
+
+/** Count and skip a packet that is too short for its headers */
+static inline int
+packet_too_short(void)
+{
+	stats.pkts_short++;
+	return 0;
+}
+
+/** An address in a packet to anonymize, and the role to tag it with */
+typedef struct addr_op_t addr_op_t;
+struct addr_op_t {
+	/** Offset of the address in the packet */
+	uint32_t     off;
+	/** 4 or 6 */
+	uint8_t      family;
+	uint8_t      role;
+};
+
+/** The most addresses anonymized in one packet (ICMPv6 with payload) */
+#define MAX_ADDR_OPS 4
+
+#define ADDR_OP(ops, n, offset, fam, r) do { \
+		(ops)[*(n)].off = (offset); \
+		(ops)[*(n)].family = (fam); \
+		(ops)[(*(n))++].role = (r); \
+	} while (0)
+
+/*
+ * Find the network layer of a packet with the given link type. Returns
+ * the offset of the IP header and sets the ethertype of what is there (0
+ * when it is not IP), or returns -1 when the packet is too short for its
+ * link layer header. The link type is the same for all packets of a file
+ * or an interface, so the switch costs next to nothing over reading the
+ * ethertype of an Ethernet frame directly.
+ */
+static ALWAYS_INLINE int
+link_decode(int linktype, const uint8_t* buf, uint32_t caplen,
+	uint16_t* ethertype)
+{
+	uint32_t l3, af;
+
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+		if (caplen < 14)
+			return -1;
+		*ethertype = buf[12] << 8 | buf[13];
+		/* 802.1Q tags, more than one for QinQ */
+		for (l3 = 14; *ethertype == 0x8100 || *ethertype == 0x88A8
+		           || *ethertype == 0x9100; l3 += 4) {
+			if (caplen < l3 + 4)
+				return -1;
+			*ethertype = buf[l3 + 2] << 8 | buf[l3 + 3];
+		}
+		return l3;
+
+	case LINKTYPE_LINUX_SLL:
+		if (caplen < 16)
+			return -1;
+		*ethertype = buf[14] << 8 | buf[15];
+		return 16;
+
+	case LINKTYPE_LINUX_SLL2:
+		if (caplen < 20)
+			return -1;
+		*ethertype = buf[0] << 8 | buf[1];
+		return 20;
+
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		if (caplen < 1)
+			return -1;
+		*ethertype = buf[0] >> 4 == 4 ? 0x0800
+		           : buf[0] >> 4 == 6 ? 0x86DD : 0;
+		return 0;
+
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		if (caplen < 4)
+			return -1;
+		/* An address family, in network byte order for LOOP and
+		 * in that of the capturing host for NULL */
+		af = linktype == LINKTYPE_LOOP || ! buf[0] ? buf[3] : buf[0];
+		*ethertype = af == 2 ? 0x0800
+		           : af == 10 || af == 24 || af == 28 || af == 30
+		           ? 0x86DD : 0;
+		return 4;
+
+	default:
+		*ethertype = 0;
+		return 0;
+	}
+}
+
+/** Whether link_decode() knows the link type */
+static inline int
+link_supported(int linktype)
+{
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+	case LINKTYPE_LINUX_SLL:
+	case LINKTYPE_LINUX_SLL2:
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * IPv6 fragment correlation. Which of the addresses of a fragmented
+ * packet is the server can only be told from the ports in its first
+ * fragment, so that is remembered by (source, destination, identification)
+ * for the fragments that follow. The table has a fixed size: each bucket
+ * is a ring of FRAG_WAYS entries in which a new first fragment overwrites
+ * the oldest one, and entries more than FRAG_TIMEOUT seconds of capture
+ * time away are ignored, so floods of fragments cost neither time nor
+ * memory. Entries hold a 64 bit hash of the key instead of the key.
+ */
+#define FRAG_BUCKETS 4096
+#define FRAG_WAYS    4
+/** Seconds a fragmented packet may take to arrive, as in RFC 8200 */
+#define FRAG_TIMEOUT 60
+
+typedef struct frag_entry_t frag_entry_t;
+struct frag_entry_t {
+	uint64_t     key;
+	uint32_t     sec;
+	/** Role of the source address, 0 for an unused entry */
+	uint8_t      role;
+};
+
+typedef struct frag_table_t frag_table_t;
+struct frag_table_t {
+	frag_entry_t e[FRAG_BUCKETS][FRAG_WAYS];
+	/** The entry of each bucket to overwrite next */
+	uint8_t      next[FRAG_BUCKETS];
+};
+
+/** Created when the first fragment is seen, one per thread */
+_Thread_local frag_table_t* frags = NULL;
+
+static inline uint64_t
+frag_key(const uint8_t* ip)
+{
+	uint32_t id;
+
+	memcpy(&id, ip + 44, sizeof(id));
+	return addrmap_hash(ip + 8, 16)
+	     ^ addrmap_hash(ip + 24, 16) * 0x9e3779b97f4a7c15ULL
+	     ^ addrmap_hash((const uint8_t*)&id, 4) * 0xc2b2ae3d27d4eb4fULL;
+}
+
+/** Append an entry to its bucket ring */
+static inline void
+frag_put(frag_table_t* t, const frag_entry_t* entry)
+{
+	size_t b = entry->key & (FRAG_BUCKETS - 1);
+
+	t->e[b][t->next[b]] = *entry;
+	t->next[b] = (t->next[b] + 1) % FRAG_WAYS;
+}
+
+/** Remember the role of the source of the first fragment at ip */
+static inline void
+frag_remember(const uint8_t* ip, uint32_t sec, uint8_t role)
+{
+	frag_entry_t entry;
+
+	if (! frags && ! (frags = calloc(1, sizeof(frag_table_t)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&entry, 0, sizeof(entry));
+	entry.key  = frag_key(ip);
+	entry.sec  = sec;
+	entry.role = role;
+	frag_put(frags, &entry);
+}
+
+/** The role of the source of the fragment at ip, or 0 when not known */
+static inline uint8_t
+frag_recall(const uint8_t* ip, uint32_t sec)
+{
+	uint64_t key;
+	size_t b;
+	int i;
+	frag_entry_t* e;
+
+	if (! frags)
+		return 0;
+	key = frag_key(ip);
+	b = key & (FRAG_BUCKETS - 1);
+	/* Newest first */
+	for (i = 1; i <= FRAG_WAYS; i++) {
+		e = &frags->e[b][(frags->next[b] + FRAG_WAYS - i) % FRAG_WAYS];
+		if (e->role && e->key == key
+		&&  sec - e->sec + FRAG_TIMEOUT <= 2 * FRAG_TIMEOUT)
+			return e->role;
+	}
+	return 0;
+}
+
+/*
+ * Return to, with the entries of from appended in the order they were
+ * put into from, which must have started out empty. Creates to when it
+ * is NULL, frees from.
+ */
+static frag_table_t*
+frag_merge(frag_table_t* to, frag_table_t* from)
+{
+	size_t b;
+	int i;
+
+	if (! from || ! to)
+		return from ? from : to;
+	for (b = 0; b < FRAG_BUCKETS; b++)
+		for (i = 0; i < FRAG_WAYS; i++)
+			if (from->e[b][(from->next[b] + i) % FRAG_WAYS].role)
+				frag_put(to, &from->e[b][(from->next[b] + i)
+				                         % FRAG_WAYS]);
+	free(from);
+	return to;
+}
+
+/*
+ * Cache of the rewritten addresses of recent flows. A DNS exchange over
+ * TCP, or a client that keeps asking the same resolver, repeats the same
+ * pair of addresses over and over, and the rewrite of a pair depends on
+ * nothing but the addresses and which one is the server (their ids never
+ * change), so it is kept here, direct mapped on a hash of (server, client)
+ * and shared by both directions. A hit saves both table lookups. Ports
+ * are left out of the key: with a fresh source port for every query they
+ * would only turn hits into misses.
+ *
+ * Only the record loops use it, which run on one thread.
+ */
+#define FLOW_CACHE_SIZE 4096
+#define FLOW_NONE       UINT32_MAX
+
+/** Server then client address, then the same anonymized */
+typedef struct flow4_t flow4_t;
+struct flow4_t {
+	uint8_t      addrs[8];
+	uint8_t      anon[8];
+};
+
+typedef struct flow6_t flow6_t;
+struct flow6_t {
+	uint8_t      addrs[32];
+	uint8_t      anon[32];
+} __attribute__((aligned(64)));
+
+static flow4_t flows4[FLOW_CACHE_SIZE];
+static flow6_t flows6[FLOW_CACHE_SIZE];
+
+/*
+ * Missing costs the probe and the fill, and evicts table lines for
+ * nothing, so when fewer than one in FLOW_MIN_HITS lookups of a window
+ * hit the cache is left alone for the next FLOW_BACKOFF flows.
+ */
+#define FLOW_WINDOW     4096
+#define FLOW_MIN_HITS   8
+#define FLOW_BACKOFF    (1 << 20)
+
+static uint32_t flow_window_lookups;
+static uint32_t flow_window_hits;
+static uint32_t flow_backoff;
+
+/*
+ * The cache entry for the flow between server and client, which starts
+ * loading. The all zero entries are empty, so the all zero pair of
+ * addresses is not cached.
+ */
+static inline uint32_t
+flow_slot(const uint8_t* server, const uint8_t* client, int family)
+{
+	uint64_t a = 0, b = 0, c = 0, d = 0;
+	uint32_t slot;
+
+	if (flow_backoff) {
+		flow_backoff--;
+		return FLOW_NONE;
+	}
+	if (family == 4) {
+		memcpy(&a, server, 4);
+		memcpy(&b, client, 4);
+	} else {
+		memcpy(&a, server, 8);
+		memcpy(&c, server + 8, 8);
+		memcpy(&b, client, 8);
+		memcpy(&d, client + 8, 8);
+	}
+	if (! (a | b | c | d))
+		return FLOW_NONE;
+	/* murmur3 finalizer, as in addrmap_hash() */
+	a ^= b * 0x9e3779b97f4a7c15ULL ^ c * 0xc2b2ae3d27d4eb4fULL
+	   ^ d * 0x165667b19e3779f9ULL;
+	a ^= a >> 33;
+	a *= 0xff51afd7ed558ccdULL;
+	a ^= a >> 33;
+	a *= 0xc4ceb9fe1a85ec53ULL;
+	a ^= a >> 33;
+	slot = a & (FLOW_CACHE_SIZE - 1);
+	if (family == 4)
+		__builtin_prefetch(&flows4[slot]);
+	else
+		__builtin_prefetch(&flows6[slot]);
+	return slot;
+}
+
+/** The addresses and anonymized addresses of a cache entry */
+static inline uint8_t*
+flow_entry(uint32_t slot, int family, uint8_t** anon)
+{
+	if (family == 4) {
+		*anon = flows4[slot].anon;
+		return flows4[slot].addrs;
+	}
+	*anon = flows6[slot].anon;
+	return flows6[slot].addrs;
+}
+
+/** Rewrite the server and client addresses from the cache when it has them */
+static inline int
+flow_hit(uint32_t slot, uint8_t* server, uint8_t* client, int family)
+{
+	size_t len = family == 4 ? 4 : 16;
+	uint8_t *addrs, *anon;
+
+	if (slot == FLOW_NONE)
+		return 0;
+	stats.flow_lookups++;
+	if (++flow_window_lookups == FLOW_WINDOW) {
+		if (flow_window_hits * FLOW_MIN_HITS < FLOW_WINDOW)
+			flow_backoff = FLOW_BACKOFF;
+		flow_window_lookups = flow_window_hits = 0;
+	}
+	addrs = flow_entry(slot, family, &anon);
+	if (memcmp(addrs, server, len) || memcmp(addrs + len, client, len))
+		return 0;
+	memcpy(server, anon, len);
+	memcpy(client, anon + len, len);
+	stats.flow_hits++;
+	flow_window_hits++;
+	return 1;
+}
+
+/** Put the server and client addresses in the cache, before rewriting them */
+static inline void
+flow_begin(uint32_t slot, const uint8_t* server, const uint8_t* client,
+	int family)
+{
+	size_t len = family == 4 ? 4 : 16;
+	uint8_t *addrs, *anon;
+
+	addrs = flow_entry(slot, family, &anon);
+	memcpy(addrs, server, len);
+	memcpy(addrs + len, client, len);
+}
+
+/** And the rewritten ones after */
+static inline void
+flow_end(uint32_t slot, const uint8_t* server, const uint8_t* client,
+	int family)
+{
+	size_t len = family == 4 ? 4 : 16;
+	uint8_t *anon;
+
+	(void) flow_entry(slot, family, &anon);
+	memcpy(anon, server, len);
+	memcpy(anon + len, client, len);
+}
+
+/*
+ * Mapping epochs (--epoch). Capture time is cut into epochs of
+ * epoch_secs seconds from 1970 on, and each epoch anonymizes with tables
+ * of its own. The first packet past the end of an epoch swaps in a fresh
+ * set of tables. The old set goes to a thread of its own, which frees it
+ * and then makes the set for the next swap, so the packet loop only
+ * swaps pointers. The sets are handed over through one atomic pointer,
+ * and all a packet costs is comparing its time with the end of the epoch.
+ *
+ * Time only goes forward: packets from before the current epoch that
+ * come after its start are anonymized in it.
+ */
+typedef struct tables_t tables_t;
+struct tables_t {
+	rbtree_t     *ipv4nodes;
+	rbtree_t     *ipv6nets;
+	rbtree_t     *ipv6nodes;
+	addrmap_t    *ipv4nodes_hash;
+	addrmap_t    *ipv6nets_hash;
+	addrmap_t    *ipv6nodes_hash;
+	ipv4direct_t *ipv4nodes_direct;
+	arena_t       node_arena;
+	spill_t      *spill;
+};
+
+/** The key the --cryptopan key of each epoch is derived from */
+uint8_t  epoch_key[32];
+/** A set of tables ready for the next swap, or NULL */
+static _Atomic(tables_t*) epoch_standby = NULL;
+
+/** A set of empty tables of the configured kinds */
+tables_t*
+tables_create(int hugepages)
+{
+	tables_t* t = calloc(1, sizeof(tables_t));
+
+	if (! t) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	arena_init(&t->node_arena, hugepages);
+	if (map_backend == MAP_HASH) {
+		t->ipv6nets_hash  = addrmap_create(6);
+		t->ipv6nodes_hash = addrmap_create(16);
+	} else {
+		t->ipv6nets  = rbtree_create(ipv6netcmp);
+		t->ipv6nodes = rbtree_create(ipv6cmp);
+	}
+	if (ipv4_backend == MAP_DIRECT)
+		t->ipv4nodes_direct = ipv4direct_create();
+	else if (ipv4_backend == MAP_HASH)
+		t->ipv4nodes_hash = addrmap_create(4);
+	else
+		t->ipv4nodes = rbtree_create(ipv4cmp);
+	if (max_mem && ! cryptopan) {
+		t->spill = spill_create(max_mem);
+		addrmap_spill(t->ipv4nodes_hash, t->spill);
+		addrmap_spill(t->ipv6nets_hash, t->spill);
+		addrmap_spill(t->ipv6nodes_hash, t->spill);
+	}
+	return t;
+}
+
+void
+tables_free(tables_t* t)
+{
+	if (! t)
+		return;
+	ipv4direct_free(t->ipv4nodes_direct);
+	arena_free(&t->node_arena);
+	rbtree_free(t->ipv4nodes);
+	rbtree_free(t->ipv6nodes);
+	rbtree_free(t->ipv6nets);
+	addrmap_free(t->ipv4nodes_hash);
+	addrmap_free(t->ipv6nodes_hash);
+	addrmap_free(t->ipv6nets_hash);
+	spill_free(t->spill);
+	free(t);
+}
+
+/** Make t the current tables, with no addresses in them yet */
+void
+tables_install(tables_t* t)
+{
+	ipv4nodes        = t->ipv4nodes;
+	ipv6nets         = t->ipv6nets;
+	ipv6nodes        = t->ipv6nodes;
+	ipv4nodes_hash   = t->ipv4nodes_hash;
+	ipv6nets_hash    = t->ipv6nets_hash;
+	ipv6nodes_hash   = t->ipv6nodes_hash;
+	ipv4nodes_direct = t->ipv4nodes_direct;
+	node_arena       = t->node_arena;
+	addr_spill       = t->spill;
+	n_ipv4nodes = n_ipv6nets = n_ipv6nodes = 0;
+	free(t);
+}
+
+/** The current tables, for swapping out */
+tables_t*
+tables_take(void)
+{
+	tables_t* t = calloc(1, sizeof(tables_t));
+
+	if (! t) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	t->ipv4nodes        = ipv4nodes;
+	t->ipv6nets         = ipv6nets;
+	t->ipv6nodes        = ipv6nodes;
+	t->ipv4nodes_hash   = ipv4nodes_hash;
+	t->ipv6nets_hash    = ipv6nets_hash;
+	t->ipv6nodes_hash   = ipv6nodes_hash;
+	t->ipv4nodes_direct = ipv4nodes_direct;
+	t->node_arena       = node_arena;
+	t->spill            = addr_spill;
+	return t;
+}
+
+/** Free the tables of a past epoch, then make the set for the next swap */
+void*
+epoch_release(void* arg)
+{
+	tables_t* old = arg;
+	tables_t* fresh;
+	tables_t* none = NULL;
+	int hugepages = old->node_arena.hugepages;
+
+	tables_free(old);
+	fresh = tables_create(hugepages);
+	if (! atomic_compare_exchange_strong(&epoch_standby, &none, fresh))
+		tables_free(fresh);
+	return NULL;
+}
+
+/*
+ * Derive the --cryptopan key of an epoch from master: the epoch number,
+ * big-endian so that all machines derive the same key, encrypted with
+ * the AES key of master, in the first block with a last byte of 0 and in
+ * the second with a last byte of 1.
+ */
+void
+epoch_derive(const uint8_t master[32], uint64_t epoch, uint8_t key[32])
+{
+	uint8_t rk[11][16], block[16];
+	int i;
+
+	aes_init_sbox();
+	aes128_expand_key(master, rk);
+	memset(block, 0, sizeof(block));
+	for (i = 0; i < 8; i++)
+		block[i] = (uint8_t)(epoch >> (56 - 8 * i));
+	aes128_encrypt(rk, block, key);
+	block[15] = 1;
+	aes128_encrypt(rk, block, key + 16);
+	memset(rk, 0, sizeof(rk));
+}
+
+/*
+ * Check epoch_derive() against the key it must give for epoch 1 under
+ * the master key 00 01 .. 1f, so that a build that derives other keys
+ * than the rest never gets to anonymize anything.
+ */
+void
+epoch_derive_check(void)
+{
+	static const uint8_t expect[32] = {
+		0x13, 0x18, 0x9a, 0x6a, 0xe4, 0xab, 0x07, 0xae,
+		0x70, 0xa3, 0xaa, 0xbd, 0x30, 0xbe, 0x99, 0xde,
+		0x8f, 0x94, 0x29, 0x44, 0x4c, 0x8f, 0x4b, 0x35,
+		0x99, 0x42, 0x12, 0x35, 0xb5, 0x10, 0xdf, 0x3d };
+	uint8_t master[32], key[32];
+	int i;
+
+	for (i = 0; i < 32; i++)
+		master[i] = i;
+	epoch_derive(master, 1, key);
+	if (memcmp(key, expect, sizeof(key))) {
+		fprintf(stderr, "epoch key derivation failed its known answer "
+		                "check\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** The --cryptopan key of an epoch, derived from epoch_key */
+void
+epoch_cryptopan(uint64_t epoch)
+{
+	uint8_t key[32];
+	int roles = cryptopan->roles;
+
+	epoch_derive(epoch_key, epoch, key);
+	free(cryptopan);
+	cryptopan = cryptopan_create(key, roles);
+	memset(key, 0, sizeof(key));
+}
+
+/*
+ * Start the epoch of the packet at sec, swapping in fresh tables when it
+ * is not the first. The old tables go to epoch_release(), and the flow
+ * cache is emptied, as it holds rewrites to their ids.
+ */
+void
+epoch_advance(uint64_t sec)
+{
+	uint64_t epoch = sec / epoch_secs;
+	tables_t* fresh;
+	tables_t* old;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (epoch_end) {
+		if (! (fresh = atomic_exchange(&epoch_standby, NULL)))
+			fresh = tables_create(node_arena.hugepages);
+		old = tables_take();
+		tables_install(fresh);
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, epoch_release, old))
+			(void) epoch_release(old);
+		pthread_attr_destroy(&attr);
+		memset(flows4, 0, sizeof(flows4));
+		memset(flows6, 0, sizeof(flows6));
+		stats.last_addrs = 0;
+		stats.epochs++;
+	}
+	epoch_end = (epoch + 1) * epoch_secs;
+	if (epoch_tagging)
+		epoch_tag = (uint32_t)epoch;
+	if (cryptopan)
+		epoch_cryptopan(epoch);
+}
+
+/** Start a new epoch when the packet at sec is past the current one */
+static inline void
+epoch_check(uint64_t sec)
+{
+	if (epoch_secs && sec >= epoch_end)
+		epoch_advance(sec);
+}
+
+/** Seconds in a timestamp of ts units of 10^-tsresol or 2^-tsresol */
+static inline uint32_t
+ts_seconds(uint64_t ts, uint8_t tsresol)
+{
+	uint64_t units = 1;
+
+	if (tsresol & 0x80)
+		return (tsresol & 0x7F) < 64 ? ts >> (tsresol & 0x7F) : 0;
+	while (tsresol-- && units < UINT64_MAX / 10)
+		units *= 10;
+	return ts / units;
+}
+
+/*
+ * Find the addresses to anonymize in the packet in buf, whose IP header
+ * (with the given ethertype) starts at l3, in the order in which they
+ * are to be looked up, and its statistics class.
+ * The addresses must be anonymized even when the packet is not written,
+ * because they have been assigned an id already.
+ *
+ * Returns 1 when the packet should be written, or 0 when it is not DNS
+ * related, or too short to reach the headers that need anonymizing.
+ */
+static inline int
+classify_headers(const uint8_t* buf, uint32_t caplen, uint16_t ethertype,
+	uint32_t l3, uint32_t sec, int* cls, addr_op_t* ops, int* n_ops)
+{
+	const uint8_t* ip = buf + l3;
+	uint32_t iplen = caplen - l3;
+	size_t hsz, hsz2;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t role;
+
+	switch (ethertype) {
+	case 0x0800: /* IPv4 */
+
+		*cls = STAT_IPV4_OTHER;
+		if (iplen < 20)
+			return packet_too_short();
+
+		*cls = ip[9] == 17 ? STAT_IPV4_UDP
+		     : ip[9] ==  6 ? STAT_IPV4_TCP
+		     : ip[9] ==  1 ? STAT_IPV4_ICMP : STAT_IPV4_OTHER;
+
+		if ((hsz = (ip[0] & 0x0F) * 4) < 20)
+			hsz = 20;
+
+		/* UDP || TCP */
+		if (ip[9] == 17 || ip[9] == 6) { 
+			if (iplen < hsz + 4)
+				return packet_too_short();
+
+			src_port = ip[hsz]     << 8 | ip[hsz + 1];
+			dst_port = ip[hsz + 2] << 8 | ip[hsz + 3];
+
+			if (DNS_PORT(src_port)) { /* dns response */
+				ADDR_OP(ops, n_ops, l3 + 12, 4, 2);
+				ADDR_OP(ops, n_ops, l3 + 16, 4, 1);
+			} else if (DNS_PORT(dst_port)) { /* dns request */
+				ADDR_OP(ops, n_ops, l3 + 12, 4, 1);
+				ADDR_OP(ops, n_ops, l3 + 16, 4, 2);
+			} else { /* non-dns packet! */
+				return 0;
+			}
+			return 1;
+
+		} else if (ip[9] != 1)
+			return 0;
+
+		/* Assume sender is the server. */
+		ADDR_OP(ops, n_ops, l3 + 12, 4, 2);
+		ADDR_OP(ops, n_ops, l3 + 16, 4, 1);
+
+		if (iplen < hsz + 1)
+			return packet_too_short();
+
+		if (ip[hsz] != 3 && ip[hsz] !=  4 &&
+		    ip[hsz] != 5 && ip[hsz] != 11)
+			/* ICMP without IP header payload */
+			return 1;
+
+		/* ICMP with IP header payload
+		 * Check if it involves DNS traffic and anonimize
+		 * accordingly.
+		 */
+		if (iplen < hsz + 28)
+			return packet_too_short();
+
+		/* Non UDP or TCP payload, continue */
+		if (ip[hsz + 17] != 17 && ip[hsz + 17] != 6)
+			return 0;
+
+		if ((hsz2 = (ip[hsz + 8] & 0x0F) * 4) < 20)
+			hsz2 = 20;
+
+		if (iplen < hsz + 12 + hsz2)
+			return packet_too_short();
+
+		src_port = ip[hsz +  8 + hsz2] << 8 | ip[hsz +  9 + hsz2];
+		dst_port = ip[hsz + 10 + hsz2] << 8 | ip[hsz + 11 + hsz2];
+
+
+		if (DNS_PORT(src_port)) { /* dns response */
+			ADDR_OP(ops, n_ops, l3 + hsz + 20, 4, 2);
+			ADDR_OP(ops, n_ops, l3 + hsz + 24, 4, 1);
+		} else if (DNS_PORT(dst_port)) { /* dns request */
+			ADDR_OP(ops, n_ops, l3 + hsz + 20, 4, 1);
+			ADDR_OP(ops, n_ops, l3 + hsz + 24, 4, 2);
+		} else { /* non-dns payload! */
+			return 0;
+		}
+		return 1;
+
+	case 0x86DD: /* IPv6 */
+
+		*cls = STAT_IPV6_OTHER;
+		if (iplen < 40)
+			return packet_too_short();
+
+		*cls = ip[6] == 17 ? STAT_IPV6_UDP
+		     : ip[6] ==  6 ? STAT_IPV6_TCP
+		     : ip[6] == 58 ? STAT_IPV6_ICMP
+		     : ip[6] == 44 ? STAT_IPV6_FRAG : STAT_IPV6_OTHER;
+
+		if (ip[6] == 58) { /* Next header == IPv6-ICMP */
+			if (iplen < 41)
+				return packet_too_short();
+			if (ip[40] >= 100) {
+				/* ICMPv6 type without payload */
+				return 0;
+			}
+			if (iplen < 88)
+				return packet_too_short();
+			/* client, src ns, dst ns, router */
+			ADDR_OP(ops, n_ops, l3 + 72, 6, 1);
+			ADDR_OP(ops, n_ops, l3 + 56, 6, 2);
+			ADDR_OP(ops, n_ops, l3 + 24, 6, 2);
+			ADDR_OP(ops, n_ops, l3 +  8, 6, 3);
+		} else if (ip[6] == 17 || ip[6] == 6) {
+			/* UDP || TCP */
+			if (iplen < 44)
+				return packet_too_short();
+
+			src_port = ip[40] << 8 | ip[41];
+			dst_port = ip[42] << 8 | ip[43];
+
+			if (DNS_PORT(src_port)) { /* dns response */
+				ADDR_OP(ops, n_ops, l3 +  8, 6, 2);
+				ADDR_OP(ops, n_ops, l3 + 24, 6, 1);
+			} else if (DNS_PORT(dst_port)) { /* dns request */
+				ADDR_OP(ops, n_ops, l3 +  8, 6, 1);
+				ADDR_OP(ops, n_ops, l3 + 24, 6, 2);
+			} else { /* non-dns packet! */
+				return 0;
+			}
+		} else if (ip[6] == 44) { /* Next hdr == Fragment */
+			/* The roles of the IP addresses are in the ports
+			 * of the first fragment, the fragments after it
+			 * are correlated with it in the fragment table.
+			 *
+			 * Tag them with code 4444 when it is not known.
+			 */
+			role = 0;
+			if (iplen >= 48 && ip[42] == 0 && ! (ip[43] & 0xF8)) {
+				/* First fragment */
+				if (iplen >= 52 && (ip[40] == 17 || ip[40] == 6)) {
+					src_port = ip[48] << 8 | ip[49];
+					dst_port = ip[50] << 8 | ip[51];
+					role = DNS_PORT(src_port) ? 2
+					     : DNS_PORT(dst_port) ? 1 : 0;
+					if (role)
+						frag_remember(ip, sec, role);
+				}
+			} else if (iplen >= 48)
+				role = frag_recall(ip, sec);
+
+			ADDR_OP(ops, n_ops, l3 +  8, 6, role ? role : 4);
+			ADDR_OP(ops, n_ops, l3 + 24, 6, role ? 3 - role : 4);
+
+			/* Though...
+			 * when a fragmented ICMPv6 with type < 100
+			 *
+			 * is fragmented (impossible in theory),
+			 * we should anonymize the payload...
+			 */
+			if (iplen >= 49 &&
+			    ip[40] == 58 && ip[42] == 0 &&
+			    ip[43] ==  0 && ip[48] < 100 ) {
+				/* First fragment for 
+				 * IPv6-ICMP type < 100
+				 */
+				if (iplen < 96)
+					return packet_too_short();
+				/* client, src ns */
+				ADDR_OP(ops, n_ops, l3 + 80, 6, 1);
+				ADDR_OP(ops, n_ops, l3 + 64, 6, 2);
+			}
+		}
+		/* Other next headers are passed on as they are, and
+		 * counted as ipv6_other */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Find the addresses to anonymize in the packet in buf, captured on a
+ * link of type linktype at sec seconds, with classify_headers(), and
+ * drop the packet when the filter does not pass its class. Its addresses
+ * then do not get an id either.
+ */
+int classify_packet(const uint8_t* buf, uint32_t caplen, int linktype,
+	uint32_t sec, int* cls, addr_op_t* ops, int* n_ops)
+{
+	uint16_t ethertype;
+	int l3, keep;
+
+	*n_ops = 0;
+	*cls = STAT_OTHER;
+	if ((l3 = link_decode(linktype, buf, caplen, &ethertype)) < 0)
+		return packet_too_short();
+
+	keep = classify_headers( buf, caplen, ethertype, l3, sec
+	                       , cls, ops, n_ops);
+	if (FILTER_PASSES(*cls))
+		return keep;
+	*n_ops = 0;
+	return 0;
+}
+
+/** Anonymize the addresses found by classify_packet() in buf in place */
+static inline void
+apply_addr_ops(uint8_t* buf, const addr_op_t* ops, int n_ops)
+{
+	int i;
+
+	if (cryptopan) {
+		for (i = 0; i < n_ops; i++) {
+			if (ops[i].family == 6)
+				cryptopan_replace6(buf + ops[i].off, ops[i].role);
+			else
+				cryptopan_replace4(buf + ops[i].off, ops[i].role);
+		}
+		return;
+	}
+	for (i = 0; i < n_ops; i++) {
+		if (ops[i].family == 6)
+			lookup_and_replace6(buf + ops[i].off, ops[i].role);
+		else
+			lookup_and_replace4(buf + ops[i].off, ops[i].role);
+	}
+}
+
+/*
+ * Anonymize the addresses in the packet in buf, captured on a link of
+ * type linktype at sec seconds, in place.
+ *
+ * Returns 1 when the packet should be written, 0 when it is to be skipped.
+ */
+static inline int
+anonymize_packet(uint8_t* buf, uint32_t caplen, int linktype, uint32_t sec,
+	int* cls)
+{
+	addr_op_t ops[MAX_ADDR_OPS];
+	int n_ops, keep;
+
+	keep = classify_packet(buf, caplen, linktype, sec, cls, ops, &n_ops);
+	apply_addr_ops(buf, ops, n_ops);
+	return keep;
+}
+
+/*
+ * Records are anonymized in batches: each record is decoded as soon as
+ * it is cut from the input, and once the batch is full its packets are
+ * classified together, starting the loads of the table entries their
+ * lookups will need. The lookups of the whole batch are done afterwards,
+ * in record order so the ids come out the same. That way the cache
+ * misses of a batch overlap instead of stalling one packet after the
+ * other.
+ */
+#define RECORD_BATCH 16
+
+typedef struct batch_entry_t batch_entry_t;
+struct batch_entry_t {
+	uint8_t     *rec;
+	size_t       len;
+	/** The packet in the record, NULL when there is none */
+	uint8_t     *pkt;
+	uint32_t     caplen;
+	int          linktype;
+	/** Capture time in units of 10^-tsresol or 2^-tsresol seconds */
+	uint64_t     ts;
+	uint8_t      tsresol;
+	/** Offset of the IP header in the packet, set by the prefilter */
+	uint32_t     l3;
+	/** Flow cache entry of DNS over UDP or TCP, or FLOW_NONE */
+	uint32_t     flow;
+	addr_op_t    ops[MAX_ADDR_OPS];
+	int          n_ops;
+	int          cls;
+	/** Write the record */
+	int          keep;
+};
+
+/*
+ * Prefilter for the packets of a batch. The fields that decide the fate
+ * of plain UDP and TCP packets (ethertype, protocol and whether a port
+ * is in dns_ports) are loaded when a packet is decoded, and then compared
+ * for the whole batch at once, with AVX2 or SSE2 where the CPU has it.
+ * DNS over UDP or TCP gets its addresses to anonymize straight from the
+ * outcome, other UDP and TCP packets and non IP packets are passed over
+ * without further work, and only the rest (ICMP, fragments, other
+ * protocols and short packets) is left to classify_packet().
+ */
+#define PF_SLOW  0
+#define PF_SKIP  1
+#define PF_QUERY 2
+#define PF_REPLY 3
+
+typedef struct pf_lanes_t pf_lanes_t;
+struct pf_lanes_t {
+	uint16_t ethertype[RECORD_BATCH] __attribute__((aligned(32)));
+	uint16_t proto[RECORD_BATCH]     __attribute__((aligned(32)));
+	/** 0xFFFF when the port is one of dns_ports */
+	uint16_t src_dns[RECORD_BATCH]   __attribute__((aligned(32)));
+	uint16_t dst_dns[RECORD_BATCH]   __attribute__((aligned(32)));
+	/** 0xFFFF when the packet is long enough for the fields above */
+	uint16_t ok[RECORD_BATCH]        __attribute__((aligned(32)));
+	/** One of the PF_ outcomes */
+	uint16_t action[RECORD_BATCH]    __attribute__((aligned(32)));
+};
+
+typedef struct batch_t batch_t;
+struct batch_t {
+	batch_entry_t e[RECORD_BATCH];
+	pf_lanes_t   lanes;
+	int          n;
+};
+
+/** 2 for AVX2, 1 for SSE2, 0 for the plain C prefilter */
+static int pf_simd = 0;
+
+static void
+prefilter_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	pf_simd = __builtin_cpu_supports("avx2") ? 2
+	        : __builtin_cpu_supports("sse2") ? 1 : 0;
+#endif
+}
+
+/** Load the fields of packet i of a batch, the same way classify_packet() does */
+static inline void
+pf_load(pf_lanes_t* l, int i, batch_entry_t* e)
+{
+	const uint8_t* ip;
+	uint32_t iplen;
+	size_t hsz;
+	int l3;
+
+	l->ok[i] = 0;
+	e->flow  = FLOW_NONE;
+	l3 = link_decode(e->linktype, e->pkt, e->caplen, &l->ethertype[i]);
+	if (l3 < 0)
+		return;
+	e->l3 = l3;
+	ip    = e->pkt + l3;
+	iplen = e->caplen - l3;
+
+	if (l->ethertype[i] == 0x0800) {
+		if (iplen < 20)
+			return;
+		if ((hsz = (ip[0] & 0x0F) * 4) < 20)
+			hsz = 20;
+		if (iplen < hsz + 4)
+			return;
+		l->proto[i]   = ip[9];
+		l->src_dns[i] = -DNS_PORT(ip[hsz]     << 8 | ip[hsz + 1]);
+		l->dst_dns[i] = -DNS_PORT(ip[hsz + 2] << 8 | ip[hsz + 3]);
+		if ((ip[9] == 17 || ip[9] == 6) && (l->src_dns[i] | l->dst_dns[i]))
+			e->flow = l->src_dns[i] ? flow_slot(ip + 12, ip + 16, 4)
+			                        : flow_slot(ip + 16, ip + 12, 4);
+
+	} else if (l->ethertype[i] == 0x86DD) {
+		if (iplen < 44)
+			return;
+		l->proto[i]   = ip[6];
+		l->src_dns[i] = -DNS_PORT(ip[40] << 8 | ip[41]);
+		l->dst_dns[i] = -DNS_PORT(ip[42] << 8 | ip[43]);
+		if ((ip[6] == 17 || ip[6] == 6) && (l->src_dns[i] | l->dst_dns[i]))
+			e->flow = l->src_dns[i] ? flow_slot(ip + 8, ip + 24, 6)
+			                        : flow_slot(ip + 24, ip + 8, 6);
+	}
+	l->ok[i] = 0xFFFF;
+}
+
+static void
+pf_compute_plain(pf_lanes_t* l)
+{
+	int i, ip;
+
+	for (i = 0; i < RECORD_BATCH; i++) {
+		ip = l->ethertype[i] == 0x0800 || l->ethertype[i] == 0x86DD;
+		if (! l->ok[i])
+			l->action[i] = PF_SLOW;
+		else if (! ip)
+			l->action[i] = PF_SKIP;
+		else if (l->proto[i] != 17 && l->proto[i] != 6)
+			l->action[i] = PF_SLOW;
+		else
+			l->action[i] = l->src_dns[i] ? PF_REPLY
+			             : l->dst_dns[i] ? PF_QUERY : PF_SKIP;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * The outcome for a vector of lanes, all of whose bits are set or clear:
+ *
+ *   fast   = ok & ip & (udp | tcp)
+ *   action = fast ? (reply ? 3 : query ? 2 : 1) : (ok & ~ip ? 1 : 0)
+ */
+#define PF_COMPUTE(V, set1, load, store, cmpeq, and, andnot, or) do { \
+		V c0800 = set1(0x0800), c86dd = set1((short)0x86DD); \
+		V c17 = set1(17), c6 = set1(6); \
+		V c1 = set1(1), c2 = set1(2), c3 = set1(3); \
+		V ip, ut, reply, query, fast, act; \
+		ip    = load((V*)(l->ethertype + i)); \
+		ip    = or(cmpeq(ip, c0800), cmpeq(ip, c86dd)); \
+		ut    = load((V*)(l->proto + i)); \
+		ut    = or(cmpeq(ut, c17), cmpeq(ut, c6)); \
+		reply = load((V*)(l->src_dns + i)); \
+		query = andnot(reply, load((V*)(l->dst_dns + i))); \
+		fast  = and(load((V*)(l->ok + i)), and(ip, ut)); \
+		act   = or(and(reply, c3), or(and(query, c2), \
+		                              andnot(or(reply, query), c1))); \
+		act   = or(and(fast, act), \
+		           and(andnot(ip, load((V*)(l->ok + i))), c1)); \
+		store((V*)(l->action + i), act); \
+	} while (0)
+
+__attribute__((target("sse2")))
+void pf_compute_sse2(pf_lanes_t* l)
+{
+	int i;
+
+	for (i = 0; i < RECORD_BATCH; i += 8)
+		PF_COMPUTE(__m128i, _mm_set1_epi16, _mm_load_si128,
+		    _mm_store_si128, _mm_cmpeq_epi16, _mm_and_si128,
+		    _mm_andnot_si128, _mm_or_si128);
+}
+
+__attribute__((target("avx2")))
+void pf_compute_avx2(pf_lanes_t* l)
+{
+	int i;
+
+	for (i = 0; i < RECORD_BATCH; i += 16)
+		PF_COMPUTE(__m256i, _mm256_set1_epi16, _mm256_load_si256,
+		    _mm256_store_si256, _mm256_cmpeq_epi16, _mm256_and_si256,
+		    _mm256_andnot_si256, _mm256_or_si256);
+}
+#endif
+
+/** Classify the packets of the batch and prefetch for their lookups */
+static inline void
+batch_classify(batch_t* b)
+{
+	pf_lanes_t* l = &b->lanes;
+	batch_entry_t* e;
+	uint32_t server, client;
+	int i, j, v6;
+
+	for (i = b->n; i < RECORD_BATCH; i++)
+		l->ok[i] = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if (pf_simd == 2)
+		pf_compute_avx2(l);
+	else if (pf_simd == 1)
+		pf_compute_sse2(l);
+	else
+#endif
+		pf_compute_plain(l);
+
+	for (i = 0; i < b->n; i++) {
+		e = &b->e[i];
+		if (! e->pkt)
+			continue;
+
+		v6 = l->ethertype[i] == 0x86DD;
+		e->n_ops = 0;
+		switch (l->action[i]) {
+		case PF_SLOW:
+			e->keep = classify_packet(e->pkt, e->caplen, e->linktype,
+			    ts_seconds(e->ts, e->tsresol), &e->cls,
+			    e->ops, &e->n_ops);
+			break;
+		case PF_SKIP:
+			e->cls = l->ethertype[i] == 0x0800
+			       ? (l->proto[i] == 17 ? STAT_IPV4_UDP : STAT_IPV4_TCP)
+			       : v6
+			       ? (l->proto[i] == 17 ? STAT_IPV6_UDP : STAT_IPV6_TCP)
+			       : STAT_OTHER;
+			e->keep = 0;
+			break;
+		default:
+			e->cls = v6
+			       ? (l->proto[i] == 17 ? STAT_IPV6_UDP : STAT_IPV6_TCP)
+			       : (l->proto[i] == 17 ? STAT_IPV4_UDP : STAT_IPV4_TCP);
+			e->keep = FILTER_PASSES(e->cls);
+			/* Server then client */
+			if (l->action[i] == PF_REPLY) {
+				server = e->l3 + (v6 ?  8 : 12);
+				client = e->l3 + (v6 ? 24 : 16);
+			} else {
+				server = e->l3 + (v6 ? 24 : 16);
+				client = e->l3 + (v6 ?  8 : 12);
+			}
+			if (! e->keep || flow_hit( e->flow, e->pkt + server
+			                         , e->pkt + client, v6 ? 6 : 4)) {
+				e->flow = FLOW_NONE;
 				break;
+			}
+			/* Looked up in the order of the packet */
+			if (l->action[i] == PF_REPLY) {
+				ADDR_OP(e->ops, &e->n_ops, server, v6 ? 6 : 4, 2);
+				ADDR_OP(e->ops, &e->n_ops, client, v6 ? 6 : 4, 1);
+			} else {
+				ADDR_OP(e->ops, &e->n_ops, client, v6 ? 6 : 4, 1);
+				ADDR_OP(e->ops, &e->n_ops, server, v6 ? 6 : 4, 2);
+			}
+			break;
+		}
+		if (cryptopan)
+			continue;
+		for (j = 0; j < e->n_ops; j++)
+			lookup_prefetch(e->pkt + e->ops[j].off, e->ops[j].family);
+	}
+}
+
+/*
+ * Does a packet of the batch start a new epoch? Then the batch goes
+ * packet by packet, so the lookups before the swap are in the old tables
+ * and those after it in the new ones.
+ */
+static inline int
+batch_crosses_epoch(const batch_t* b)
+{
+	const batch_entry_t* e;
+
+	for (e = b->e; e < b->e + b->n; e++)
+		if (e->pkt && ( e->tsresol ? ts_seconds(e->ts, e->tsresol)
+		                           : e->ts) >= epoch_end)
+			return 1;
+	return 0;
+}
+
+/** Do the lookups and rewrites of the batch, in order, and count its packets */
+static inline void
+batch_resolve(batch_t* b)
+{
+	batch_entry_t* e;
+	uint64_t sec;
+
+	if (epoch_secs && batch_crosses_epoch(b)) {
+		for (e = b->e; e < b->e + b->n; e++) {
+			if (! e->pkt)
+				continue;
+			sec = ts_seconds(e->ts, e->tsresol);
+			epoch_check(sec);
+			e->keep = anonymize_packet( e->pkt, e->caplen, e->linktype
+			                          , sec, &e->cls);
+			stats_packet(e->cls, e->len, e->keep);
+		}
+		return;
+	}
+	batch_classify(b);
+	for (e = b->e; e < b->e + b->n; e++) {
+		if (! e->pkt)
+			continue;
+		/* The server is the address with role 2 */
+		if (e->flow != FLOW_NONE)
+			flow_begin( e->flow, e->pkt + e->ops[e->ops[0].role == 1].off
+			          , e->pkt + e->ops[e->ops[0].role == 2].off
+			          , e->ops[0].family);
+		apply_addr_ops(e->pkt, e->ops, e->n_ops);
+		if (e->flow != FLOW_NONE)
+			flow_end( e->flow, e->pkt + e->ops[e->ops[0].role == 1].off
+			        , e->pkt + e->ops[e->ops[0].role == 2].off
+			        , e->ops[0].family);
+		stats_packet(e->cls, e->len, e->keep);
+	}
+}
+
+/** An interface of a pcapng section, or of a pcap file */
+typedef struct iface_t iface_t;
+struct iface_t {
+	uint16_t     linktype;
+	/** Timestamp units, 10^-n seconds, or 2^-n with the top bit set */
+	uint8_t      tsresol;
+};
+
+/** Decoding state of an input */
+typedef struct input_t input_t;
+struct input_t {
+	int          format;
+	/** The current pcapng section is in the other byte order */
+	int          swapped;
+	/** The interfaces of the current pcapng section */
+	iface_t     *ifaces;
+	uint32_t     n_ifaces;
+	uint32_t     max_ifaces;
+};
+
+static inline uint32_t
+input_u32(const input_t* input, const uint8_t* p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return input->swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t
+input_u16(const input_t* input, const uint8_t* p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return input->swapped ? __builtin_bswap16(v) : v;
+}
+
+static void
+input_corrupt(void)
+{
+	fprintf(stderr, "corrupt pcapng block\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Return the length of the record (a pcap packet record or a pcapng
+ * block) at buf when all of it is within the avail bytes there, or 0
+ * when it is not. Follows the byte order of pcapng sections, so must
+ * see all records in order.
+ *
+ * format is input->format, passed as a constant by the record loops so
+ * that each gets a copy for each format.
+ */
+static ALWAYS_INLINE size_t
+record_len(input_t* input, int format, const uint8_t* buf, size_t avail)
+{
+	uint32_t len, bom;
+
+	if (format != FMT_PCAPNG) {
+		if (avail < sizeof(struct pcap_pkthdr))
+			return 0;
+		memcpy(&len, buf + 8, sizeof(len));
+		if (format == FMT_PCAP_SWAPPED)
+			len = __builtin_bswap32(len);
+		return (size_t)len + sizeof(struct pcap_pkthdr) <= avail
+		     ? (size_t)len + sizeof(struct pcap_pkthdr) : 0;
+	}
+	if (avail < 12)
+		return 0;
+	memcpy(&len, buf, sizeof(len));
+	if (len == PCAPNG_SHB) {
+		memcpy(&bom, buf + 8, sizeof(bom));
+		if (bom == PCAPNG_BYTE_ORDER_MAGIC)
+			input->swapped = 0;
+		else if (bom == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+			input->swapped = 1;
+		else
+			input_corrupt();
+	}
+	len = input_u32(input, buf + 4);
+	if (len < 12 || len % 4)
+		input_corrupt();
+	return len <= avail ? len : 0;
+}
+
+/** Add the next interface of the section */
+static void
+input_add_iface(input_t* input, uint16_t linktype, uint8_t tsresol)
+{
+	if (input->n_ifaces == input->max_ifaces) {
+		input->max_ifaces = input->max_ifaces ? input->max_ifaces * 2 : 8;
+		input->ifaces = realloc( input->ifaces
+		                       , input->max_ifaces * sizeof(iface_t));
+		if (! input->ifaces) {
+			fprintf(stderr, "mem allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	input->ifaces[input->n_ifaces].linktype = linktype;
+	input->ifaces[input->n_ifaces++].tsresol = tsresol;
+}
+
+/** The if_tsresol option of the interface description block rec */
+static uint8_t
+input_tsresol(const input_t* input, const uint8_t* rec, size_t len)
+{
+	size_t pos;
+	uint16_t code, optlen;
+
+	for (pos = 16; pos + 4 <= len - 4; pos += 4 + ((optlen + 3) & ~3)) {
+		code   = input_u16(input, rec + pos);
+		optlen = input_u16(input, rec + pos + 2);
+		if (code == 0)
+			break;
+		if (code == 9 && optlen >= 1 && pos + 5 <= len - 4)
+			return rec[pos + 4];
+	}
+	/* Microseconds */
+	return 6;
+}
+
+/*
+ * Set the packet at off in the record of the last entry of the batch,
+ * with its timestamp in the units of its interface.
+ */
+static ALWAYS_INLINE void
+record_packet( const input_t* input, batch_t* b, uint32_t iface
+             , uint32_t off, uint32_t caplen, uint64_t ts)
+{
+	batch_entry_t* e = &b->e[b->n - 1];
+
+	if (iface >= input->n_ifaces
+	||  ! link_supported(input->ifaces[iface].linktype)) {
+		/* No way to find the addresses */
+		stats_packet(STAT_OTHER, e->len, 0);
+		e->keep = 0;
+		return;
+	}
+	e->pkt      = e->rec + off;
+	e->caplen   = caplen;
+	e->linktype = input->ifaces[iface].linktype;
+	e->ts       = ts;
+	e->tsresol  = input->ifaces[iface].tsresol;
+	pf_load(&b->lanes, b->n - 1, e);
+}
+
+/*
+ * Decode the record rec of len bytes (as returned by record_len) into
+ * the next entry of the batch, which must not be full. Its packet gets
+ * anonymized in place by batch_resolve(); packets of pcapng blocks are
+ * rewritten within the block, so blocks are written as they are, like
+ * pcap records. Whether to write the record is in the entry's keep.
+ */
+static ALWAYS_INLINE void
+record_decode( input_t* input, int format, uint8_t* rec, size_t len
+             , batch_t* b)
+{
+	batch_entry_t* e = &b->e[b->n++];
+	uint32_t off, caplen, iface;
+	uint32_t hdr[4];
+	uint64_t ts;
+	int i;
+
+	e->rec  = rec;
+	e->len  = len;
+	e->pkt  = NULL;
+	e->keep = 1;
+	b->lanes.ok[b->n - 1] = 0;
+
+	if (format == FMT_PCAP_SWAPPED) {
+		/* Written in our byte order */
+		memcpy(hdr, rec, sizeof(hdr));
+		for (i = 0; i < 4; i++)
+			hdr[i] = __builtin_bswap32(hdr[i]);
+		memcpy(rec, hdr, sizeof(hdr));
+	}
+	if (format != FMT_PCAPNG) {
+		/* The file header is interface 0, the seconds of the
+		 * timestamp are enough */
+		memcpy(hdr, rec, sizeof(hdr));
+		record_packet(input, b, 0, sizeof(struct pcap_pkthdr)
+		             , len - sizeof(struct pcap_pkthdr), hdr[0]);
+		return;
+	}
+	switch (input_u32(input, rec)) {
+	case PCAPNG_SHB:
+		input->n_ifaces = 0;
+		if (len >= 24) {
+			/* Dropped blocks change the section length */
+			memset(rec + 16, 0xff, 8);
+		}
+		return;
+
+	case PCAPNG_IDB:
+		if (len < 20)
+			input_corrupt();
+		input_add_iface( input, input_u16(input, rec + 8)
+		               , input_tsresol(input, rec, len));
+		return;
+
+	case PCAPNG_EPB:
+	case PCAPNG_PB:
+		if (len < 32)
+			input_corrupt();
+		iface = input_u32(input, rec) == PCAPNG_EPB
+		      ? input_u32(input, rec + 8) : input_u16(input, rec + 8);
+		ts = (uint64_t)input_u32(input, rec + 12) << 32
+		   | input_u32(input, rec + 16);
+		caplen = input_u32(input, rec + 20);
+		off = 28;
+		if (caplen > len - 32)
+			input_corrupt();
+		break;
+
+	case PCAPNG_SPB:
+		if (len < 16)
+			input_corrupt();
+		iface = 0;
+		/* Without timestamp, fragments only expire by number */
+		ts = 0;
+		caplen = input_u32(input, rec + 8);
+		if (caplen > len - 16)
+			caplen = len - 16;
+		off = 12;
+		break;
+
+	case PCAPNG_NRB:
+		/* Names with their addresses in the clear */
+		e->keep = 0;
+		return;
+
+	default:
+		return;
+	}
+	record_packet(input, b, iface, off, caplen, ts);
+}
+
+/** Resolve the batch, write the records to keep by copy and empty it */
+static inline void
+batch_copy(batch_t* b, writer_t* out)
+{
+	batch_entry_t* e;
+
+	batch_resolve(b);
+	for (e = b->e; e < b->e + b->n; e++)
+		if (e->keep)
+			writer_copy(out, e->rec, e->len);
+	b->n = 0;
+}
+
+/** Resolve the batch, write the records to keep by reference and empty it */
+static inline void
+batch_ref(batch_t* b, writer_t* out)
+{
+	batch_entry_t* e;
+
+	batch_resolve(b);
+	for (e = b->e; e < b->e + b->n; e++)
+		if (e->keep) {
+			/* Records are adjacent in the map, and consecutive
+			 * records are written with one iovec */
+			writer_ref(out, e->rec, e->len);
+		}
+	b->n = 0;
+}
+
+/** Size of the buffer streamed input is read into */
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+/** anonymize_stream() for input of the given format */
+static ALWAYS_INLINE void
+stream_records( FILE* in, input_t* input, int format
+              , const uint8_t* head, size_t head_len, writer_t* out)
+{
+	uint8_t* buf;
+	size_t bufsz = STREAM_BUFFER_SIZE;
+	size_t have = head_len, pos, len, sz, want;
+	batch_t b;
+
+	if (! (buf = malloc(bufsz))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(buf, head, head_len);
+	for (;;) {
+		want = bufsz - have;
+		sz = fread(buf + have, 1, want, in);
+		have += sz;
+
+		b.n = 0;
+		for ( pos = 0
+		    ; (len = record_len(input, format, buf + pos, have - pos))
+		    ; pos += len) {
+			record_decode(input, format, buf + pos, len, &b);
+			if (b.n == RECORD_BATCH)
+				batch_copy(&b, out);
+		}
+		batch_copy(&b, out);
+		/* A short read means end of input (or an error) */
+		if (sz < want) {
+			if (pos < have)
+				stats.pkts_truncated++;
+			break;
+		}
+		/* Carry the partial record over, growing the buffer for
+		 * records larger than it */
+		have -= pos;
+		memmove(buf, buf + pos, have);
+		if (have == bufsz) {
+			bufsz *= 2;
+			if (! (buf = realloc(buf, bufsz))) {
+				fprintf(stderr, "mem allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Copy the records from the in stream to out, anonymizing them on the
+ * way. The first head_len bytes of the input were read already and are
+ * in head.
+ */
+void anonymize_stream( FILE* in, input_t* input
+                     , const uint8_t* head, size_t head_len, writer_t* out)
+{
+	switch (input->format) {
+	case FMT_PCAP:
+		stream_records(in, input, FMT_PCAP, head, head_len, out);
+		break;
+	case FMT_PCAPNG:
+		stream_records(in, input, FMT_PCAPNG, head, head_len, out);
+		break;
+	default:
+		stream_records(in, input, FMT_PCAP_SWAPPED, head, head_len, out);
+		break;
+	}
+}
+
+/** Processed input is dropped from memory in steps of this size */
+#define MMAP_RELEASE_SIZE (64 * 1024 * 1024)
+
+/** anonymize_mapped() for input of the given format */
+static ALWAYS_INLINE void
+mapped_records( uint8_t* map, size_t size, size_t pos
+              , input_t* input, int format, writer_t* out)
+{
+	size_t released = 0;
+	size_t written = 0;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t len;
+	batch_t b;
+
+	b.n = 0;
+	while ((len = record_len(input, format, map + pos, size - pos))) {
+		record_decode(input, format, map + pos, len, &b);
+		pos += len;
+		if (b.n < RECORD_BATCH)
+			continue;
+		batch_ref(&b, out);
+
+		if (pos - written >= MMAP_RELEASE_SIZE) {
+			/* Everything up to the previous mark is written
+			 * once this flush returns */
+			writer_flush(out);
+			(void) madvise(map + released, written - released, MADV_DONTNEED);
+			released = written;
+			written  = pos & ~(pagesize - 1);
+		}
+	}
+	batch_ref(&b, out);
+	if (pos < size)
+		stats.pkts_truncated++;
+	writer_sync(out);
+}
+
+/*
+ * Anonymize the records of a memory mapped capture file from offset
+ * pos on in place and write them to out. The mapping must be private
+ * and writable; only the pages holding rewritten packets get copied.
+ * Processed parts of the mapping are released as we go, so memory use
+ * stays flat for large files.
+ */
+void anonymize_mapped( uint8_t* map, size_t size, size_t pos, input_t* input
+                     , writer_t* out)
+{
+	switch (input->format) {
+	case FMT_PCAP:
+		mapped_records(map, size, pos, input, FMT_PCAP, out);
+		break;
+	case FMT_PCAPNG:
+		mapped_records(map, size, pos, input, FMT_PCAPNG, out);
+		break;
+	default:
+		mapped_records(map, size, pos, input, FMT_PCAP_SWAPPED, out);
+		break;
+	}
+}
+
+/*
+ * Three stage pipeline: a reader thread cuts the input into chunks of
+ * whole records, the anonymizer (the main thread, the only one touching
+ * the mapping tables, so ids stay deterministic) rewrites them and
+ * collects iovecs for the records to keep, and a writer thread writes
+ * them out. Chunks travel between the stages over single producer,
+ * single consumer lock-free rings and are recycled by the reader.
+ */
+#define PIPELINE_CHUNKS     8	/* power of two */
+#define PIPELINE_CHUNK_SIZE (1024 * 1024)
+
+typedef struct chunk_t chunk_t;
+struct chunk_t {
+	/** The complete records in this chunk */
+	uint8_t     *data;
+	size_t       len;
+	/** Buffer owned by the chunk (streamed input only) */
+	uint8_t     *buf;
+	size_t       bufsz;
+	/** Input offset just after this chunk (mapped input only) */
+	size_t       end;
+	/** Last chunk of the input */
+	int          last;
+	/** The input ended with a truncated record */
+	int          truncated;
+	/** Records to write, adjacent records merged */
+	struct iovec *iov;
+	int          n_iov;
+	int          max_iov;
+};
+
+typedef struct ring_t ring_t;
+struct ring_t {
+	_Alignas(64) _Atomic size_t head;	/* written by the consumer */
+	_Alignas(64) _Atomic size_t tail;	/* written by the producer */
+	_Alignas(64) chunk_t *slots[PIPELINE_CHUNKS];
+};
+
+/** Back off while waiting for the other side of a ring */
+static inline void
+ring_wait(unsigned *spins)
+{
+	struct timespec ts = { 0, 50000 };
+
+	if (++*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} else if (*spins < 1024)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+/*
+ * As many chunks circulate as the rings can hold, so a push never finds
+ * a ring full.
+ */
+static inline void
+ring_push(ring_t *ring, chunk_t *chunk)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	ring->slots[tail & (PIPELINE_CHUNKS - 1)] = chunk;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static inline chunk_t *
+ring_pop(ring_t *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned spins = 0;
+	chunk_t *chunk;
+
+	while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+		ring_wait(&spins);
+	chunk = ring->slots[head & (PIPELINE_CHUNKS - 1)];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return chunk;
+}
+
+typedef struct pipeline_t pipeline_t;
+struct pipeline_t {
+	/** reader -> anonymizer */
+	ring_t       to_anonymize;
+	/** anonymizer -> writer */
+	ring_t       to_write;
+	/** writer -> reader */
+	ring_t       to_free;
+	chunk_t      chunks[PIPELINE_CHUNKS];
+	/** Streamed input, or NULL, and what was read of it already */
+	FILE        *in;
+	const uint8_t *head;
+	size_t       head_len;
+	/** Mapped input, or NULL, and where its first record starts */
+	uint8_t     *map;
+	size_t       map_size;
+	size_t       start;
+	/** The reader's decoding state */
+	input_t      input;
+	int          out_fd;
+};
+
+/** records_end() for input of the given format */
+static ALWAYS_INLINE size_t
+records_end_fmt( input_t* input, int format
+               , const uint8_t* buf, size_t avail, size_t limit)
+{
+	size_t pos, rec;
+
+	for ( pos = 0
+	    ; pos < limit && (rec = record_len(input, format, buf + pos, avail - pos))
+	    ; pos += rec)
+		;
+	return pos;
+}
+
+/*
+ * Return the length of the complete records in the avail bytes at buf,
+ * stopping at the first record ending at or beyond limit.
+ */
+static size_t
+records_end(input_t* input, const uint8_t* buf, size_t avail, size_t limit)
+{
+	switch (input->format) {
+	case FMT_PCAP:
+		return records_end_fmt(input, FMT_PCAP, buf, avail, limit);
+	case FMT_PCAPNG:
+		return records_end_fmt(input, FMT_PCAPNG, buf, avail, limit);
+	default:
+		return records_end_fmt(input, FMT_PCAP_SWAPPED, buf, avail, limit);
+	}
+}
+
+/** Read the input stream into chunks, carrying partial records over */
+void *
+pipeline_read_stream(void *arg)
+{
+	pipeline_t *p = arg;
+	chunk_t *chunk, *next;
+	size_t have = p->head_len, pos, sz, want;
+
+	chunk = ring_pop(&p->to_free);
+	memcpy(chunk->buf, p->head, have);
+	for (;;) {
+		want = chunk->bufsz - have;
+		sz = fread(chunk->buf + have, 1, want, p->in);
+		have += sz;
+
+		/* Cut at the last complete record */
+		pos = records_end(&p->input, chunk->buf, have, SIZE_MAX);
+		chunk->data = chunk->buf;
+		chunk->len  = pos;
+		/* A short read means end of input (or an error) */
+		chunk->last = sz < want;
+		chunk->truncated = chunk->last && pos < have;
+		if (chunk->last || pos == 0) {
+			if (chunk->last) {
+				ring_push(&p->to_anonymize, chunk);
+				return NULL;
+			}
+			/* A single record larger than the chunk */
+			chunk->bufsz *= 2;
+			if (! (chunk->buf = realloc(chunk->buf, chunk->bufsz))) {
+				fprintf(stderr, "mem allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+		next = ring_pop(&p->to_free);
+		have -= pos;
+		if (have > next->bufsz) {
+			free(next->buf);
+			next->bufsz = have;
+			if (! (next->buf = malloc(next->bufsz))) {
+				fprintf(stderr, "mem allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		memcpy(next->buf, chunk->buf + pos, have);
+		ring_push(&p->to_anonymize, chunk);
+		chunk = next;
+	}
+}
+
+/** Cut the mapped input into chunks, faulting their pages in ahead */
+void *
+pipeline_read_mapped(void *arg)
+{
+	pipeline_t *p = arg;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t pos = p->start;
+	size_t start, i;
+	volatile uint8_t touch;
+	chunk_t *chunk;
+
+	for (;;) {
+		chunk = ring_pop(&p->to_free);
+		start = pos;
+		pos += records_end( &p->input, p->map + pos, p->map_size - pos
+		                  , PIPELINE_CHUNK_SIZE);
+		for (i = start & ~(pagesize - 1); i < pos; i += pagesize)
+			touch = p->map[i];
+		(void) touch;
+
+		chunk->data = p->map + start;
+		chunk->len  = pos - start;
+		chunk->end  = pos;
+		chunk->last = pos == start || pos - start < PIPELINE_CHUNK_SIZE;
+		chunk->truncated = chunk->last && pos < p->map_size;
+		ring_push(&p->to_anonymize, chunk);
+		if (chunk->last)
+			return NULL;
+	}
+}
+
+/** Write the kept records of each chunk and hand the chunk back */
+void *
+pipeline_write(void *arg)
+{
+	pipeline_t *p = arg;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t released = 0, upto;
+	chunk_t *chunk;
+	int last;
+
+	do {
+		chunk = ring_pop(&p->to_write);
+		writev_all(p->out_fd, chunk->iov, chunk->n_iov);
+		if (p->map) {
+			/* Pages before this chunk's end are done with */
+			upto = chunk->end & ~(pagesize - 1);
+			if (upto - released >= MMAP_RELEASE_SIZE) {
+				(void) madvise( p->map + released
+				              , upto - released, MADV_DONTNEED);
+				released = upto;
+			}
+		}
+		last = chunk->last;
+		ring_push(&p->to_free, chunk);
+	} while (! last);
+	return NULL;
+}
+
+/** Add a record to write to the chunk's iovecs */
+static inline void
+chunk_keep(chunk_t *chunk, uint8_t *rec, size_t len)
+{
+	struct iovec *last;
+
+	if (chunk->n_iov) {
+		last = &chunk->iov[chunk->n_iov - 1];
+		if ((uint8_t *)last->iov_base + last->iov_len == rec) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	if (chunk->n_iov == chunk->max_iov) {
+		chunk->max_iov *= 2;
+		chunk->iov = realloc(chunk->iov, chunk->max_iov * sizeof(struct iovec));
+		if (! chunk->iov) {
+			fprintf(stderr, "mem allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	chunk->iov[chunk->n_iov].iov_base = rec;
+	chunk->iov[chunk->n_iov].iov_len  = len;
+	chunk->n_iov++;
+}
+
+/** Resolve the batch, add the records to keep to the chunk and empty it */
+static inline void
+batch_keep(batch_t* b, chunk_t* chunk)
+{
+	batch_entry_t* e;
+
+	batch_resolve(b);
+	for (e = b->e; e < b->e + b->n; e++)
+		if (e->keep)
+			chunk_keep(chunk, e->rec, e->len);
+	b->n = 0;
+}
+
+/** chunk_anonymize() for input of the given format */
+static ALWAYS_INLINE void
+chunk_anonymize_fmt(input_t* input, int format, chunk_t* chunk)
+{
+	size_t pos, len;
+	batch_t b;
+
+	chunk->n_iov = 0;
+	b.n = 0;
+	for (pos = 0; pos < chunk->len; pos += len) {
+		len = record_len(input, format, chunk->data + pos, chunk->len - pos);
+		record_decode(input, format, chunk->data + pos, len, &b);
+		if (b.n == RECORD_BATCH)
+			batch_keep(&b, chunk);
+	}
+	batch_keep(&b, chunk);
+}
+
+/** Anonymize the records of a chunk and collect the ones to keep */
+static void
+chunk_anonymize(input_t* input, chunk_t* chunk)
+{
+	switch (input->format) {
+	case FMT_PCAP:
+		chunk_anonymize_fmt(input, FMT_PCAP, chunk);
+		break;
+	case FMT_PCAPNG:
+		chunk_anonymize_fmt(input, FMT_PCAPNG, chunk);
+		break;
+	default:
+		chunk_anonymize_fmt(input, FMT_PCAP_SWAPPED, chunk);
+		break;
+	}
+}
+
+/*
+ * Run the pipeline from the stream in (of which head_len bytes in head
+ * were read already) or from offset start of the mapping map (when not
+ * NULL) to out_fd, with the anonymizer stage on the calling thread.
+ */
+void anonymize_pipeline( FILE* in, const uint8_t* head, size_t head_len
+                       , uint8_t* map, size_t map_size, size_t start
+                       , input_t* input, int out_fd)
+{
+	pipeline_t* p;
+	pthread_t reader, writer;
+	chunk_t* chunk;
+	int i, last;
+
+	if (! (p = aligned_alloc(64, sizeof(pipeline_t)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(p, 0, sizeof(pipeline_t));
+	p->in       = in;
+	p->head     = head;
+	p->head_len = head_len;
+	p->map      = map;
+	p->map_size = map_size;
+	p->start    = start;
+	p->input    = *input;
+	p->out_fd   = out_fd;
+	for (i = 0; i < PIPELINE_CHUNKS; i++) {
+		chunk = &p->chunks[i];
+		chunk->max_iov = 256;
+		chunk->iov = malloc(chunk->max_iov * sizeof(struct iovec));
+		if (! map) {
+			chunk->bufsz = PIPELINE_CHUNK_SIZE;
+			chunk->buf = malloc(chunk->bufsz);
+		}
+		if (! chunk->iov || (! map && ! chunk->buf)) {
+			fprintf(stderr, "mem allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		ring_push(&p->to_free, chunk);
+	}
+	if (pthread_create( &reader, NULL
+	                  , map ? pipeline_read_mapped : pipeline_read_stream
+	                  , p)
+	||  pthread_create(&writer, NULL, pipeline_write, p)) {
+		fprintf(stderr, "could not start pipeline threads\n");
+		exit(EXIT_FAILURE);
+	}
+
+	do {
+		chunk = ring_pop(&p->to_anonymize);
+		chunk_anonymize(input, chunk);
+		if (chunk->truncated)
+			stats.pkts_truncated++;
+		last = chunk->last;
+		ring_push(&p->to_write, chunk);
+	} while (! last);
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	for (i = 0; i < PIPELINE_CHUNKS; i++) {
+		free(p->chunks[i].iov);
+		free(p->chunks[i].buf);
+	}
+	free(p);
+}
+
+/*
+ * Two pass parallel anonymization of a mapped pcap file.
+ *
+ * The file is cut into one part per thread. In the first pass every
+ * thread collects the addresses of its part, in order of first
+ * appearance, in part local tables, and counts the bytes it will
+ * write. The local tables are then merged part by part into the global
+ * tables, which hands out the ids in the same order as a serial run
+ * would. In the second pass the threads anonymize their parts with the
+ * (now read only) global tables and write them at their own offset in
+ * the output file.
+ */
+typedef struct part_t part_t;
+struct part_t {
+	/** Records starting in [start, stop) belong to this part */
+	size_t       start;
+	size_t       stop;
+	/** Offset just after the last record, or where a record got cut */
+	size_t       end;
+	/** Output offset and size */
+	off_t        out_off;
+	uint64_t     out_bytes;
+	/** Addresses in order of first appearance in this part */
+	addrmap_t   *ipv4nodes;
+	addrmap_t   *ipv6nets;
+	addrmap_t   *ipv6nodes;
+	uint32_t     n_ipv4nodes;
+	uint32_t     n_ipv6nets;
+	uint32_t     n_ipv6nodes;
+	/** Counters of the second pass */
+	stats_t      stats;
+	pthread_t    thread;
+	/** The mapped input and output */
+	uint8_t     *map;
+	size_t       map_size;
+	int          out_fd;
+	int          linktype;
+	/** First fragments of the part, and those before it */
+	frag_table_t* frags;
+	frag_table_t* frags_before;
+};
+
+/*
+ * Is there a plausible record header at pos that the next ones chain on
+ * from? Only used to guess where a part starts; guesses are verified.
+ */
+int
+pcap_plausible( const uint8_t* map, size_t size, size_t pos
+              , uint32_t snaplen, uint32_t subsec)
+{
+	struct pcap_pkthdr pkthdr;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (pos == size)
+			return 1;
+		if (size - pos < sizeof(pkthdr))
+			return 0;
+		memcpy(&pkthdr, map + pos, sizeof(pkthdr));
+		if (pkthdr.usec >= subsec || pkthdr.caplen > snaplen
+		||  pkthdr.caplen > pkthdr.len || pkthdr.caplen < 14)
+			return 0;
+		if (pkthdr.caplen > size - pos - sizeof(pkthdr))
+			return 0;
+		pos += sizeof(pkthdr) + pkthdr.caplen;
+	}
+	return 1;
+}
 
-			/* ICMP with IP header payload
-			 * Check if it involves DNS traffic and anonimize
-			 * accordingly.
-			 */
+/** Guess the offset of the first record at or after pos */
+size_t
+pcap_resync( const uint8_t* map, size_t size, size_t pos
+           , uint32_t snaplen, uint32_t subsec)
+{
+	for (; pos < size; pos++)
+		if (pcap_plausible(map, size, pos, snaplen, subsec))
+			return pos;
+	return size;
+}
 
-			/* Non UDP or TCP payload, continue */
-			if (buf[hsz + 31] != 17 && buf[hsz + 31] != 6)
-				continue;
+/*
+ * Collect the addresses from the ops of a packet in the part's tables,
+ * giving them part local ids in order of appearance.
+ */
+void
+part_collect(part_t* part, const uint8_t* buf, const addr_op_t* ops, int n_ops)
+{
+	int i;
 
-			if ((hsz2 = (buf[hsz + 22] & 0x0F) * 4) < 20)
-				hsz2 = 20;
+	if (cryptopan)
+		/* Nothing to collect, the mapping needs no state */
+		return;
+	for (i = 0; i < n_ops; i++) {
+		if (ops[i].family == 6) {
+			(void) addrmap_lookup( part->ipv6nets, buf + ops[i].off
+			                     , 6, &part->n_ipv6nets);
+			(void) addrmap_lookup( part->ipv6nodes, buf + ops[i].off
+			                     , 16, &part->n_ipv6nodes);
+		} else
+			(void) addrmap_lookup( part->ipv4nodes, buf + ops[i].off
+			                     , 4, &part->n_ipv4nodes);
+	}
+}
 
-			src_port = buf[hsz + 22 + hsz2] << 8 | buf[hsz + 23 + hsz2];
-			dst_port = buf[hsz + 24 + hsz2] << 8 | buf[hsz + 25 + hsz2];
+/*
+ * First pass over a part. Runs on a thread of its own, as the packet
+ * counters it touches are thread local and not the ones reported.
+ */
+void *
+part_scan(void* arg)
+{
+	part_t* part = arg;
+	struct pcap_pkthdr pkthdr;
+	addr_op_t ops[MAX_ADDR_OPS];
+	size_t pos = part->start;
+	int n_ops, cls;
 
+	part->n_ipv4nodes = part->n_ipv6nets = part->n_ipv6nodes = 0;
+	part->out_bytes = 0;
+	addrmap_free(part->ipv4nodes);
+	addrmap_free(part->ipv6nets);
+	addrmap_free(part->ipv6nodes);
+	part->ipv4nodes = addrmap_create(4);
+	part->ipv6nets  = addrmap_create(6);
+	part->ipv6nodes = addrmap_create(16);
+	free(part->frags);
 
-			if (src_port == 53) { /* dns response */
-				lookup_and_replace4(&buf[hsz + 34], 2);
-				lookup_and_replace4(&buf[hsz + 38], 1);
-			} else if (dst_port == 53) { /* dns request */
-				lookup_and_replace4(&buf[hsz + 34], 1);
-				lookup_and_replace4(&buf[hsz + 38], 2);
-			} else { /* non-dns payload! */
-				continue;
-			}
+	while (pos < part->stop && part->map_size - pos >= sizeof(pkthdr)) {
+		memcpy(&pkthdr, part->map + pos, sizeof(pkthdr));
+		if (pkthdr.caplen > part->map_size - pos - sizeof(pkthdr))
 			break;
+		if (classify_packet( part->map + pos + sizeof(pkthdr)
+		                   , pkthdr.caplen, part->linktype, pkthdr.sec
+		                   , &cls, ops, &n_ops))
+			part->out_bytes += sizeof(pkthdr) + pkthdr.caplen;
+		part_collect(part, part->map + pos + sizeof(pkthdr), ops, n_ops);
+		pos += sizeof(pkthdr) + pkthdr.caplen;
+	}
+	part->end = pos;
+	part->frags = frags;
+	return NULL;
+}
 
-		case 0x86DD: /* IPv6 */
+/** Feed the keys of a part local table to id() in local id order */
+void
+part_merge_table(addrmap_t* map, uint32_t n, uint32_t (*id)(const uint8_t*))
+{
+	const uint8_t** keys;
+	uint8_t* slot;
+	size_t i;
 
-			if (buf[20] == 58) { /* Next header == IPv6-ICMP */
-				if (buf[54] >= 100) {
-					/* ICMPv6 type without payload */
-					continue;
-				}
-				router = &buf[22];
-				dst_ns = &buf[38];
-				src_ns = &buf[70];
-				client = &buf[86];
-
-				lookup_and_replace6(client, 1);
-				lookup_and_replace6(src_ns, 2);
-				lookup_and_replace6(dst_ns, 2);
-				lookup_and_replace6(router, 3);
-			} else if (buf[20] == 17 || buf[20] == 6) {
-				/* UDP || TCP */
-
-				src_port = buf[54] << 8 | buf[55];
-				dst_port = buf[56] << 8 | buf[57];
-
-				if (src_port == 53) { /* dns response */
-					lookup_and_replace6(&buf[22], 2);
-					lookup_and_replace6(&buf[38], 1);
-				} else if (dst_port == 53) { /* dns request */
-					lookup_and_replace6(&buf[22], 1);
-					lookup_and_replace6(&buf[38], 2);
-				} else { /* non-dns packet! */
-					continue;
-				}
-			} else if (buf[20] == 44) { /* Next hdr == Fragment */
-				/* To identify the role's of the IP addresses
-				 * for fragments except the first, they need toxi
-				 * be correlated (or reassembled).
-				 *
-				 * Tag them with code 4444 for now.
-				 */
-				lookup_and_replace6(&buf[22], 4);
-				lookup_and_replace6(&buf[38], 4);
-
-				/* Though...
-				 * when a fragmented ICMPv6 with type < 100
-				 *
-				 * is fragmented (impossible in theory),
-				 * we should anonymize the payload...
-				 */
-				if (buf[54] == 58 && buf[56] == 0 &&
-				    buf[57] ==  0 && buf[62] < 100 ) {
-					/* First fragment for 
-					 * IPv6-ICMP type < 100
-					 */
-					src_ns = &buf[78];
-					client = &buf[94];
-					lookup_and_replace6(client, 1);
-					lookup_and_replace6(src_ns, 2);
-				}
-			} else {
-				fprintf( stderr
-				       , "Unknown next header protocol: %d\n"
-				       , (int)buf[20]);
+	if (! (keys = malloc((n ? n : 1) * sizeof(*keys)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < map->capacity; i++) {
+		slot = map->slots + i * map->slotsize;
+		if (*(uint32_t *)slot)
+			keys[*(uint32_t *)slot - 1] = slot + 4;
+	}
+	for (i = 0; i < n; i++)
+		(void) id(keys[i]);
+	free(keys);
+}
+
+/** Second pass over a part */
+void *
+part_write(void* arg)
+{
+	part_t* part = arg;
+	struct pcap_pkthdr pkthdr;
+	struct iovec iov[WRITER_BATCH_IOVS];
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t pos = part->start;
+	size_t released = (part->start + pagesize - 1) & ~(pagesize - 1);
+	size_t upto, batch = 0;
+	off_t out_off = part->out_off;
+	int n_iov = 0, keep, cls;
+
+	stats_init(0);
+	frags = part->frags_before;
+	while (pos < part->end) {
+		memcpy(&pkthdr, part->map + pos, sizeof(pkthdr));
+		keep = anonymize_packet( part->map + pos + sizeof(pkthdr)
+		                       , pkthdr.caplen, part->linktype
+		                       , pkthdr.sec, &cls);
+		stats_packet(cls, sizeof(pkthdr) + pkthdr.caplen, keep);
+		if (keep) {
+			if (n_iov && (uint8_t *)iov[n_iov - 1].iov_base
+			           + iov[n_iov - 1].iov_len == part->map + pos)
+				iov[n_iov - 1].iov_len += sizeof(pkthdr) + pkthdr.caplen;
+			else {
+				iov[n_iov].iov_base = part->map + pos;
+				iov[n_iov].iov_len  = sizeof(pkthdr) + pkthdr.caplen;
+				n_iov++;
+			}
+			batch += sizeof(pkthdr) + pkthdr.caplen;
+		}
+		pos += sizeof(pkthdr) + pkthdr.caplen;
+
+		if (n_iov == WRITER_BATCH_IOVS || batch >= WRITER_BATCH_BYTES
+		||  pos >= part->end) {
+			pwritev_all(part->out_fd, iov, n_iov, out_off);
+			out_off += batch;
+			n_iov = 0;
+			batch = 0;
+			/* Only release pages that are entirely ours */
+			upto = pos & ~(pagesize - 1);
+			if (upto > released + MMAP_RELEASE_SIZE) {
+				(void) madvise( part->map + released
+				              , upto - released, MADV_DONTNEED);
+				released = upto;
+			}
+		}
+	}
+	part->stats = stats;
+	free(frags);
+	return NULL;
+}
+
+void
+stats_add(stats_t* to, const stats_t* from)
+{
+	int i;
+
+	to->pkts_read     += from->pkts_read;
+	to->bytes_read    += from->bytes_read;
+	to->pkts_written  += from->pkts_written;
+	to->bytes_written += from->bytes_written;
+	to->pkts_short    += from->pkts_short;
+	to->flow_lookups  += from->flow_lookups;
+	to->flow_hits     += from->flow_hits;
+	for (i = 0; i < STAT_N_CLASSES; i++) {
+		to->written[i] += from->written[i];
+		to->skipped[i] += from->skipped[i];
+	}
+}
+
+/*
+ * Anonymize the mapped file with n_threads threads, writing the records
+ * after the file header at out_off in out_fd, which must be seekable.
+ * subsec is the number of timestamp fractions in a second.
+ */
+void anonymize_parallel(uint8_t* map, size_t size, int out_fd, off_t out_off,
+	int n_threads, uint32_t snaplen, uint32_t subsec, int linktype)
+{
+	part_t* parts;
+	frag_table_t* frags_seen = NULL;
+	size_t first = sizeof(struct pcap_file_header);
+	int i;
+
+	if (! (parts = calloc(n_threads, sizeof(part_t)))) {
+		fprintf(stderr, "mem allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (snaplen < 65535)
+		snaplen = 65535;
+	for (i = 0; i < n_threads; i++) {
+		parts[i].map      = map;
+		parts[i].map_size = size;
+		parts[i].out_fd   = out_fd;
+		parts[i].linktype = linktype;
+		parts[i].start    = i == 0 ? first : pcap_resync( map, size
+		                      , first + (size - first) / n_threads * i
+		                      , snaplen, subsec);
+	}
+	for (i = 0; i < n_threads; i++)
+		parts[i].stop = i + 1 < n_threads ? parts[i + 1].start : size;
+
+	/* First pass */
+	for (i = 0; i < n_threads; i++)
+		if (pthread_create(&parts[i].thread, NULL, part_scan, &parts[i])) {
+			fprintf(stderr, "could not start thread\n");
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < n_threads; i++)
+		pthread_join(parts[i].thread, NULL);
+
+	/* A part must start where its predecessor ended, rescan the ones
+	 * that started on a wrongly guessed record boundary.
+	 */
+	for (i = 1; i < n_threads; i++) {
+		if (parts[i].start == parts[i - 1].end)
+			continue;
+		parts[i].start = parts[i - 1].end;
+		if (parts[i].stop < parts[i].start)
+			parts[i].stop = parts[i].start;
+		if (pthread_create(&parts[i].thread, NULL, part_scan, &parts[i])) {
+			fprintf(stderr, "could not start thread\n");
+			exit(EXIT_FAILURE);
+		}
+		pthread_join(parts[i].thread, NULL);
+	}
+	if (parts[n_threads - 1].end < size)
+		stats.pkts_truncated++;
+
+	/* Merge in part order, which assigns ids in first appearance order */
+	for (i = 0; i < n_threads; i++) {
+		part_merge_table( parts[i].ipv4nodes, parts[i].n_ipv4nodes
+		                , ipv4_id);
+		part_merge_table( parts[i].ipv6nets, parts[i].n_ipv6nets
+		                , ipv6net_id);
+		part_merge_table( parts[i].ipv6nodes, parts[i].n_ipv6nodes
+		                , ipv6node_id);
+		addrmap_free(parts[i].ipv4nodes);
+		addrmap_free(parts[i].ipv6nets);
+		addrmap_free(parts[i].ipv6nodes);
+		parts[i].out_off = out_off;
+		out_off += parts[i].out_bytes;
+
+		/* Fragments correlate with first fragments in the parts
+		 * before, as if those had been through the same table */
+		if (frags_seen) {
+			if (! (parts[i].frags_before = malloc(sizeof(frag_table_t)))) {
+				fprintf(stderr, "mem allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(parts[i].frags_before, frags_seen, sizeof(frag_table_t));
+		}
+		frags_seen = frag_merge(frags_seen, parts[i].frags);
+	}
+	free(frags_seen);
+
+	/* Second pass */
+	for (i = 0; i < n_threads; i++)
+		if (pthread_create(&parts[i].thread, NULL, part_write, &parts[i])) {
+			fprintf(stderr, "could not start thread\n");
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(parts[i].thread, NULL);
+		stats_add(&stats, &parts[i].stats);
+	}
+	if (lseek(out_fd, out_off, SEEK_SET) < 0) {
+		perror("could not seek output");
+		exit(EXIT_FAILURE);
+	}
+	free(parts);
+}
+
+/** Snap length in the header of live captures */
+#define LIVE_SNAPLEN 262144
+
+#ifdef __linux__
+/*
+ * Live capture from a TPACKET_V3 ring. The kernel fills blocks of
+ * packets in a ring mapped into our memory and hands a block over when
+ * it is full or has aged LIVE_BLOCK_TMO milliseconds. The packets of a
+ * block are anonymized in place and copied to the writer, and the block
+ * is handed back, so nothing unanonymized ever reaches the disk.
+ */
+#define LIVE_BLOCK_SIZE (1024 * 1024)
+#define LIVE_BLOCK_NR   64
+#define LIVE_FRAME_SIZE 2048
+#define LIVE_BLOCK_TMO  100
+
+volatile sig_atomic_t live_stop = 0;
+
+static void
+live_signal(int sig)
+{
+	(void) sig;
+	live_stop = 1;
+}
+
+/** Add the packets the kernel dropped since the last call to the stats */
+static void
+live_drops(int fd)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+		stats.pkts_dropped += st.tp_drops;
+}
+
+/** The ARPHRD_ hardware type of interface ifname */
+static int
+live_hatype(int fd, const char* ifname)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (strlen(ifname) >= sizeof(ifr.ifr_name)) {
+		fprintf(stderr, "unknown interface: %s\n", ifname);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(ifr.ifr_name, ifname);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+		if (errno == ENODEV)
+			fprintf(stderr, "unknown interface: %s\n", ifname);
+		else
+			perror("could not get interface hardware type");
+		exit(EXIT_FAILURE);
+	}
+	return ifr.ifr_hwaddr.sa_family;
+}
+
+/*
+ * The link type to capture ifname with: Ethernet and loopback frames as
+ * they are, and the packets of other interfaces, like tun, wireguard or
+ * ppp, as raw IP, without a link layer header.
+ */
+int
+live_linktype(const char* ifname)
+{
+	int fd, hatype;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("could not open socket");
+		exit(EXIT_FAILURE);
+	}
+	hatype = live_hatype(fd, ifname);
+	close(fd);
+	return hatype == ARPHRD_ETHER || hatype == ARPHRD_LOOPBACK
+	     ? LINKTYPE_ETHERNET : LINKTYPE_RAW;
+}
+
+/*
+ * Open a packet socket on ifname with a TPACKET_V3 ring mapped at *ring,
+ * giving packets of linktype (from live_linktype()). The kernel strips
+ * the link layer header for raw IP.
+ * On loopback every frame passes twice, as it goes out and as it comes
+ * back in, so *loopback is set to have live_block() skip the outgoing
+ * copies, should the kernel not do that itself.
+ */
+int
+live_open(const char* ifname, int linktype, uint8_t** ring, int* loopback)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	int fd, version = TPACKET_V3;
+
+	if ((fd = socket( AF_PACKET
+	                , linktype == LINKTYPE_RAW ? SOCK_DGRAM : SOCK_RAW
+	                , htons(ETH_P_ALL))) < 0) {
+		perror("could not open packet socket");
+		exit(EXIT_FAILURE);
+	}
+	if ((*loopback = live_hatype(fd, ifname) == ARPHRD_LOOPBACK)) {
+#ifdef PACKET_IGNORE_OUTGOING
+		int ignore = 1;
+
+		(void) setsockopt( fd, SOL_PACKET, PACKET_IGNORE_OUTGOING
+		                 , &ignore, sizeof(ignore));
+#endif
+	}
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("could not select TPACKET_V3");
+		exit(EXIT_FAILURE);
+	}
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = LIVE_BLOCK_SIZE;
+	req.tp_block_nr   = LIVE_BLOCK_NR;
+	req.tp_frame_size = LIVE_FRAME_SIZE;
+	req.tp_frame_nr   = LIVE_BLOCK_SIZE / LIVE_FRAME_SIZE * LIVE_BLOCK_NR;
+	req.tp_retire_blk_tov = LIVE_BLOCK_TMO;
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		perror("could not set up capture ring");
+		exit(EXIT_FAILURE);
+	}
+	*ring = mmap( NULL, (size_t)LIVE_BLOCK_SIZE * LIVE_BLOCK_NR
+	            , PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*ring == MAP_FAILED) {
+		perror("could not map capture ring");
+		exit(EXIT_FAILURE);
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family   = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	if (! (sll.sll_ifindex = if_nametoindex(ifname))) {
+		fprintf(stderr, "unknown interface: %s\n", ifname);
+		exit(EXIT_FAILURE);
+	}
+	if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+		perror("could not bind to interface");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/*
+ * Anonymize and write the packets of a block the kernel handed over,
+ * but for the outgoing ones on loopback
+ */
+static void
+live_block(struct tpacket_block_desc* bd, int linktype, int loopback,
+	writer_t* out)
+{
+	struct tpacket3_hdr* h;
+	struct sockaddr_ll* sll;
+	struct pcap_pkthdr pkthdr;
+	uint8_t* pkt;
+	uint32_t i;
+	int keep, cls;
+
+	h = (struct tpacket3_hdr*)((uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+		sll = (struct sockaddr_ll*)
+		    ((uint8_t*)h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		if (loopback && sll->sll_pkttype == PACKET_OUTGOING) {
+			h = (struct tpacket3_hdr*)((uint8_t*)h + h->tp_next_offset);
+			continue;
+		}
+		pkt = (uint8_t*)h + h->tp_mac;
+		pkthdr.sec    = h->tp_sec;
+		pkthdr.usec   = h->tp_nsec;
+		pkthdr.caplen = h->tp_snaplen;
+		pkthdr.len    = h->tp_len;
+		epoch_check(pkthdr.sec);
+		keep = anonymize_packet( pkt, pkthdr.caplen, linktype
+		                       , pkthdr.sec, &cls);
+		stats_packet(cls, sizeof(pkthdr) + pkthdr.caplen, keep);
+		if (keep) {
+			/* The block goes back to the kernel */
+			writer_copy(out, &pkthdr, sizeof(pkthdr));
+			writer_copy(out, pkt, pkthdr.caplen);
+		}
+		h = (struct tpacket3_hdr*)((uint8_t*)h + h->tp_next_offset);
+	}
+}
+
+/*
+ * Capture from ifname until interrupted, writing the anonymized packets
+ * of linktype (with nanosecond timestamps) to out.
+ */
+void
+anonymize_live(const char* ifname, int linktype, writer_t* out)
+{
+	struct tpacket_block_desc* bd;
+	struct sigaction sa;
+	struct pollfd pfd;
+	uint8_t* ring;
+	unsigned cur = 0;
+	int fd, loopback;
+
+	fd = live_open(ifname, linktype, &ring, &loopback);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = live_signal;
+	(void) sigaction(SIGINT, &sa, NULL);
+	(void) sigaction(SIGTERM, &sa, NULL);
+	pfd.fd     = fd;
+	pfd.events = POLLIN | POLLERR;
+
+	while (! live_stop) {
+		bd = (struct tpacket_block_desc*)(ring + (size_t)cur * LIVE_BLOCK_SIZE);
+		if (! (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+		       & TP_STATUS_USER)) {
+			/* Idle, get what we have to the output */
+			writer_flush(out);
+			if (stats.progress_interval > 0)
+				stats_progress();
+			pfd.revents = 0;
+			(void) poll(&pfd, 1, 1000);
+			continue;
+		}
+		live_block(bd, linktype, loopback, out);
+		__atomic_store_n( &bd->hdr.bh1.block_status, TP_STATUS_KERNEL
+		                , __ATOMIC_RELEASE);
+		cur = (cur + 1) % LIVE_BLOCK_NR;
+		live_drops(fd);
+	}
+	live_drops(fd);
+	munmap(ring, (size_t)LIVE_BLOCK_SIZE * LIVE_BLOCK_NR);
+	close(fd);
+}
+#else
+int
+live_linktype(const char* ifname)
+{
+	(void) ifname;
+	return LINKTYPE_ETHERNET;
+}
+
+void
+anonymize_live(const char* ifname, int linktype, writer_t* out)
+{
+	(void) ifname;
+	(void) linktype;
+	(void) out;
+	fprintf(stderr, "live capture needs linux\n");
+	exit(EXIT_FAILURE);
+}
+#endif
+
+void usage(const char* progname)
+{
+	fprintf(stderr, "usage: %s [options] in.pcap out.anonymized.pcap\n"
+	       "       %s [options] -i IFACE out.anonymized.pcap\n"
+	       "\n"
+	       "Reads pcap, in either byte order and with micro or nanosecond\n"
+	       "timestamps, or pcapng, and writes the same format back (pcap in\n"
+	       "the byte order of this machine). Packets can be Ethernet, with or\n"
+	       "without VLAN tags, Linux cooked (SLL and SLL2), raw IP or BSD\n"
+	       "loopback.\n"
+	       "\n"
+	       "  -m, --map hash|rbtree  address mapping tables (default: hash)\n"
+	       "  -4, --ipv4-map hash|rbtree|direct\n"
+	       "                         IPv4 mapping table (default: as --map)\n"
+	       "      --hugepages        back the rbtree node arena with huge pages\n"
+	       "      --no-mmap          read input files as a stream\n"
+	       "  -P, --pipeline         read, anonymize and write on separate threads\n"
+	       "  -j, --jobs N           anonymize a regular file in two passes with\n"
+	       "                         N threads (0: one per cpu)\n"
+	       "  -f, --state FILE       load the mappings from FILE when it exists,\n"
+	       "                         and save them to FILE at exit\n"
+	       "  -k, --cryptopan KEYFILE\n"
+	       "                         stateless prefix-preserving anonymization\n"
+	       "                         keyed with 32 bytes (or 64 hex digits)\n"
+	       "                         from KEYFILE instead of the mapping tables\n"
+	       "  -r, --roles            with --cryptopan, encode the roles in the\n"
+	       "                         addresses like the mapping tables do\n"
+	       "  -p, --progress SECS    seconds between progress lines (default: 10)\n"
+	       "  -s, --stats FILE       write a JSON summary to FILE (- for stdout)\n"
+	       "                         instead of stderr\n"
+	       "  -q, --quiet            no progress lines or summary on stderr\n"
+	       "  -i, --interface IFACE  capture live from IFACE until interrupted,\n"
+	       "                         instead of reading in.pcap\n"
+	       "      --ports LIST       ports that make UDP and TCP packets DNS,\n"
+	       "                         as in 53,853,5353 or 5300-5399 (default: 53)\n"
+	       "      --filter EXPR      only write packets that match EXPR, made of\n"
+	       "                         ip, ip6, udp, tcp, icmp, icmp6 and frag with\n"
+	       "                         and, or, not and parentheses\n"
+	       "      --max-mem SIZE     keep the hash mapping tables to SIZE bytes (K,\n"
+	       "                         M or G), moving the least recently used\n"
+	       "                         addresses to a file in $TMPDIR and back\n"
+	       "                         when seen again\n"
+	       "      --epoch SECS       anonymize each SECS (or m, h or d) of capture\n"
+	       "                         time from 1970 on with tables of its own, or\n"
+	       "                         with a --cryptopan key of its own\n"
+	       "      --epoch-tag        put the number of the epoch in bytes 12 to\n"
+	       "                         15 of anonymized IPv6 addresses\n"
+	       "      --compress-level N compression level for .gz and .zst output\n"
+	       "      --compress-threads N\n"
+	       "                         zstd compression threads (default: one per\n"
+	       "                         cpu)\n"
+	       "\n"
+	       "gzip and zstd compressed input is recognized by its contents, output\n"
+	       "to a file ending in .gz or .zst is compressed.\n"
+	       , progname, progname);
+}
+
+int main(int argc, char** argv)
+{
+	FILE* in;
+	int out_fd;
+	writer_t* out;
+	struct pcap_file_header file_header;
+	struct stat st;
+	uint8_t* map = NULL;
+	size_t map_size = 0;
+	size_t sz;
+	input_t input = { FMT_PCAP, 0, NULL, 0, 0 };
+	const uint8_t* head = NULL;
+	size_t head_len = 0;
+	size_t start = sizeof(file_header);
+
+	static const struct option long_options[] = {
+		{ "map",       required_argument, NULL, 'm' },
+		{ "ipv4-map",  required_argument, NULL, '4' },
+		{ "hugepages", no_argument,       NULL, 'H' },
+		{ "no-mmap",   no_argument,       NULL, 'S' },
+		{ "pipeline",  no_argument,       NULL, 'P' },
+		{ "jobs",      required_argument, NULL, 'j' },
+		{ "state",     required_argument, NULL, 'f' },
+		{ "cryptopan", required_argument, NULL, 'k' },
+		{ "roles",     no_argument,       NULL, 'r' },
+		{ "progress",  required_argument, NULL, 'p' },
+		{ "stats",     required_argument, NULL, 's' },
+		{ "quiet",     no_argument,       NULL, 'q' },
+		{ "compress-level",   required_argument, NULL, 'L' },
+		{ "compress-threads", required_argument, NULL, 'T' },
+		{ "interface", required_argument, NULL, 'i' },
+		{ "ports",     required_argument, NULL, 'O' },
+		{ "filter",    required_argument, NULL, 'F' },
+		{ "max-mem",   required_argument, NULL, 'M' },
+		{ "epoch",     required_argument, NULL, 'E' },
+		{ "epoch-tag", no_argument,       NULL, 'e' },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ NULL,        0,                 NULL,  0  }
+	};
+	int opt;
+	int hugepages = 0;
+	int ipv4_map = -1;
+	int use_mmap = 1;
+	int pipeline = 0;
+	int jobs = 1;
+	off_t out_off = 0;
+	double progress = 10;
+	int quiet = 0;
+	const char* stats_fn = NULL;
+	const char* state_fn = NULL;
+	const char* key_fn = NULL;
+	uint8_t key[32];
+	int roles = 0;
+	const char* in_fn;
+	const char* out_fn;
+	const char* ifname = NULL;
+	int compress_level = -1;
+	int compress_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int method;
+	codec_t* decompressor = NULL;
+	int input_failed = 0;
+	codec_t* compressor = NULL;
+	FILE* compressed_in = NULL;
+	int compressed_fd = -1;
+
+	/* Handle arguments
+	 */
+	while ((opt = getopt_long(argc, argv, "m:4:Pj:f:k:rp:s:qi:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "hash") == 0)
+				map_backend = MAP_HASH;
+			else if (strcmp(optarg, "rbtree") == 0)
+				map_backend = MAP_RBTREE;
+			else {
+				fprintf(stderr, "unknown map type: %s\n", optarg);
+				usage(*argv);
+				return 1;
 			}
 			break;
+		case '4':
+			if (strcmp(optarg, "hash") == 0)
+				ipv4_map = MAP_HASH;
+			else if (strcmp(optarg, "rbtree") == 0)
+				ipv4_map = MAP_RBTREE;
+			else if (strcmp(optarg, "direct") == 0)
+				ipv4_map = MAP_DIRECT;
+			else {
+				fprintf(stderr, "unknown map type: %s\n", optarg);
+				usage(*argv);
+				return 1;
+			}
+			break;
+		case 'H':
+			hugepages = 1;
+			break;
+		case 'S':
+			use_mmap = 0;
+			break;
+		case 'P':
+			pipeline = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'f':
+			state_fn = optarg;
+			break;
+		case 'k':
+			key_fn = optarg;
+			break;
+		case 'r':
+			roles = 1;
+			break;
+		case 'p':
+			progress = atof(optarg);
+			break;
+		case 's':
+			stats_fn = optarg;
+			break;
+		case 'q':
+			progress = 0;
+			quiet = 1;
+			break;
+		case 'L':
+			compress_level = atoi(optarg);
+			break;
+		case 'T':
+			compress_threads = atoi(optarg);
+			break;
+		case 'i':
+			ifname = optarg;
+			break;
+		case 'O':
+			dns_ports_parse(optarg);
+			break;
+		case 'F':
+			filter_compile(optarg);
+			break;
+		case 'M':
+			max_mem = size_parse(optarg);
+			break;
+		case 'E':
+			epoch_secs = secs_parse(optarg);
+			break;
+		case 'e':
+			epoch_tagging = 1;
+			break;
+		case 'h':
+			usage(*argv);
+			return 0;
 		default:
-			continue;
+			usage(*argv);
+			return 1;
+		}
+	}
+	if (argc - optind != (ifname ? 1 : 2)) {
+		usage(*argv);
+		return 1;
+	}
+	if (stats_fn && strcmp(stats_fn, "-") == 0
+	&&  strcmp(argv[argc - 1], "-") == 0) {
+		fprintf(stderr, "--stats - would mix the summary into the "
+		                "output on stdout\n");
+		return 1;
+	}
+	if (ifname && (jobs != 1 || pipeline)) {
+		fprintf(stderr, "--jobs and --pipeline have no use with --interface\n");
+		return 1;
+	}
+	if (key_fn && state_fn) {
+		fprintf(stderr, "--state has no use with --cryptopan\n");
+		return 1;
+	}
+	if (max_mem && (map_backend != MAP_HASH
+	                || (ipv4_map >= 0 && ipv4_map != MAP_HASH))) {
+		fprintf(stderr, "--max-mem needs the hash mapping tables\n");
+		return 1;
+	}
+	if (epoch_tagging && (! epoch_secs || key_fn)) {
+		fprintf(stderr, "--epoch-tag needs --epoch and the mapping tables\n");
+		return 1;
+	}
+	if (max_mem && max_mem < SPILL_MIN_BUDGET) {
+		fprintf(stderr, "--max-mem needs at least %dK\n"
+		              , SPILL_MIN_BUDGET / 1024);
+		return 1;
+	}
+	if (key_fn) {
+		cryptopan_read_key(key_fn, key);
+		cryptopan = cryptopan_create(key, roles);
+		if (epoch_secs) {
+			epoch_derive_check();
+			memcpy(epoch_key, key, sizeof(key));
 		}
+		memset(key, 0, sizeof(key));
+	}
+	in_fn  = ifname ? NULL : argv[optind];
+	out_fn = argv[argc - 1];
 
-		fprintf( stderr
-		       , "pos: %ld, pkt, len: %u, caplen: %u\n"
-		       , ftell(in) , pkthdr.len , pkthdr.caplen );
+	if (ifname) {
+		in = NULL;
+	} else if (in_fn[0] == '-' && in_fn[1] == 0) {
+		in = stdin;
+	} else {
+		in = fopen(in_fn, "r");
+		if (! in) {
+			perror("could not open input");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (out_fn[0] == '-' && out_fn[1] == 0) {
+		out_fd = STDOUT_FILENO;
+	} else {
+		out_fd = open(out_fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (out_fd < 0) {
+			perror("could not open output");
+			exit(EXIT_FAILURE);
+		}
+		/* Packets are written to the compressor's pipe */
+		if ((method = compress_extension(out_fn))) {
+			compressed_fd = out_fd;
+			compressor = compress_start( method, compressed_fd
+			                           , compress_level, compress_threads);
+			out_fd = compressor->fd;
+		}
+	}
+	
+	/* Regular input files are memory mapped and processed in place
+	 */
+	if (in && in != stdin && use_mmap && fstat(fileno(in), &st) == 0
+	&&  S_ISREG(st.st_mode) && (size_t)st.st_size >= sizeof(file_header)) {
+		map_size = st.st_size;
+		map = mmap( NULL, map_size, PROT_READ | PROT_WRITE
+		          , MAP_PRIVATE, fileno(in), 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+		} else {
+			(void) madvise(map, map_size, MADV_SEQUENTIAL);
+#ifdef POSIX_FADV_SEQUENTIAL
+			(void) posix_fadvise( fileno(in), 0, 0
+			                    , POSIX_FADV_SEQUENTIAL);
+#endif
+		}
+	}
 
-		sz = fwrite(&pkthdr, sizeof(pkthdr), 1, out);
+	/* Check and copy header
+	 */
+	if (ifname) {
+		memset(&file_header, 0, sizeof(file_header));
+		file_header.magic         = PCAP_MAGIC_NS;
+		file_header.version_major = 2;
+		file_header.version_minor = 4;
+		file_header.snaplen       = LIVE_SNAPLEN;
+		file_header.linktype      = live_linktype(ifname);
+	} else if (map) {
+		memcpy(&file_header, map, sizeof(file_header));
+	} else {
+		sz = fread(&file_header, sizeof(file_header), 1, in);
 		if (sz < 1) {
-			perror("could not write packet header");
+			perror("could not read file header");
 			exit(EXIT_FAILURE);
 		}
-		sz = fwrite(buf, pkthdr.caplen, 1, out);
+	}
+	if ((method = compress_magic( (const uint8_t*)&file_header
+	                            , sizeof(file_header)))) {
+		/* Read the decompressor's pipe as a stream instead */
+		if (map) {
+			munmap(map, map_size);
+			map = NULL;
+			decompressor = decompress_start(method, in, NULL, 0);
+		} else
+			decompressor = decompress_start( method, in
+			                               , &file_header
+			                               , sizeof(file_header));
+		compressed_in = in;
+		if (! (in = fdopen(decompressor->fd, "r"))) {
+			perror("could not open decompressor pipe");
+			exit(EXIT_FAILURE);
+		}
+		sz = fread(&file_header, sizeof(file_header), 1, in);
 		if (sz < 1) {
-			perror("could not write packet");
+			perror("could not read file header");
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (in != stdin) {
+	if (file_header.magic == PCAPNG_SHB) {
+		/* pcapng blocks go out as they come in, the header we
+		 * read is the start of the first section header block */
+		input.format = FMT_PCAPNG;
+		head     = (const uint8_t*)&file_header;
+		head_len = sizeof(file_header);
+		start    = 0;
+	} else if (file_header.magic == __builtin_bswap32(PCAP_MAGIC)
+	       ||  file_header.magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+		/* Written in our byte order */
+		input.format = FMT_PCAP_SWAPPED;
+		file_header.magic         = __builtin_bswap32(file_header.magic);
+		file_header.version_major = __builtin_bswap16(file_header.version_major);
+		file_header.version_minor = __builtin_bswap16(file_header.version_minor);
+		file_header.thiszone      = (int32_t)__builtin_bswap32(file_header.thiszone);
+		file_header.sigfigs       = (int32_t)__builtin_bswap32(file_header.sigfigs);
+		file_header.snaplen       = (int32_t)__builtin_bswap32(file_header.snaplen);
+		file_header.linktype      = (int32_t)__builtin_bswap32(file_header.linktype);
+	} else if (file_header.magic != PCAP_MAGIC
+	       &&  file_header.magic != PCAP_MAGIC_NS) {
+		fprintf(stderr, "input is not in pcap or pcapng format\n");
+		exit(EXIT_FAILURE);
+	}
+	if (input.format != FMT_PCAPNG) {
+		/* The upper bits are for FCS lengths and such */
+		input_add_iface(&input, file_header.linktype & 0xFFFF, 0);
+		if (! link_supported(file_header.linktype & 0xFFFF))
+			fprintf(stderr, "unsupported link type %d, no packets "
+			                "will be written\n"
+			              , (int)(file_header.linktype & 0xFFFF));
+	}
+	out = writer_open(out_fd);
+	if (input.format != FMT_PCAPNG)
+		writer_copy(out, &file_header, sizeof(file_header));
+	ipv4_backend = ipv4_map >= 0 ? ipv4_map : map_backend;
+	tables_install(tables_create(hugepages));
+
+	/* A state bigger than --max-mem stays as loaded, the maps only
+	 * grow no further */
+	if (state_fn)
+		(void) state_load(state_fn);
+
+	/* Modify and copy packets
+	 */
+	stats_init(progress);
+	prefilter_init();
+	if (jobs != 1 && ! map && ! ifname) {
+		fprintf(stderr, "--jobs needs a regular input file, "
+		                "continuing with one thread\n");
+		jobs = 1;
+	}
+	if (jobs != 1 && epoch_secs) {
+		fprintf(stderr, "--jobs does not do --epoch, "
+		                "continuing with one thread\n");
+		jobs = 1;
+	}
+	if (jobs != 1 && addr_spill) {
+		fprintf(stderr, "--jobs does not keep to --max-mem, "
+		                "continuing with one thread\n");
+		jobs = 1;
+	}
+	if (jobs != 1 && input.format != FMT_PCAP) {
+		fprintf(stderr, "--jobs needs pcap input in our byte order, "
+		                "continuing with one thread\n");
+		jobs = 1;
+	}
+	if (jobs != 1) {
+		writer_sync(out);
+		out_off = lseek(out_fd, 0, SEEK_CUR);
+		if (out_off < 0) {
+			fprintf(stderr, "--jobs needs a regular output file, "
+			                "continuing with one thread\n");
+			jobs = 1;
+		}
+	}
+	if (jobs != 1) {
+		if (jobs <= 0)
+			jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		anonymize_parallel( map, map_size, out_fd, out_off, jobs > 0 ? jobs : 1
+		                  , (uint32_t)file_header.snaplen
+		                  , file_header.magic == PCAP_MAGIC_NS
+		                    ? 1000000000 : 1000000
+		                  , input.ifaces[0].linktype);
+		munmap(map, map_size);
+	} else if (ifname) {
+		anonymize_live(ifname, file_header.linktype, out);
+	} else if (pipeline) {
+		writer_sync(out);
+		anonymize_pipeline( map ? NULL : in, head, head_len
+		                  , map, map_size, start, &input, out_fd);
+		if (map)
+			munmap(map, map_size);
+	} else if (map) {
+		anonymize_mapped(map, map_size, start, &input, out);
+		munmap(map, map_size);
+	} else {
+		anonymize_stream(in, &input, head, head_len, out);
+	}
+	if (in && in != stdin) {
 		fclose(in);
 	}
-	if (out != stdout) {
-		fclose(out);
+	if (decompressor) {
+		/* The output is complete as far as the input goes */
+		input_failed = codec_finish(decompressor);
+		if (compressed_in != stdin)
+			fclose(compressed_in);
 	}
-	return 0;
+	writer_close(out);
+	if (out_fd != STDOUT_FILENO && close(out_fd) < 0) {
+		perror("could not close output");
+		exit(EXIT_FAILURE);
+	}
+	if (compressor) {
+		codec_finish(compressor);
+		if (close(compressed_fd) < 0) {
+			perror("could not close output");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (state_fn)
+		state_save(state_fn);
+	if (stats_fn) {
+		FILE* stats_fp = strcmp(stats_fn, "-") == 0
+		               ? stdout : fopen(stats_fn, "w");
+
+		if (! stats_fp) {
+			perror("could not open statistics file");
+			exit(EXIT_FAILURE);
+		}
+		stats_json(stats_fp);
+		if (stats_fp != stdout)
+			fclose(stats_fp);
+	} else if (! quiet)
+		stats_json(stderr);
+
+	tables_free(tables_take());
+	tables_free(atomic_exchange(&epoch_standby, NULL));
+	if (state_map)
+		munmap(state_map, state_map_size);
+	free(cryptopan);
+	free(input.ifaces);
+	return input_failed ? EXIT_FAILURE : 0;
 }
 